@@ -77,11 +77,15 @@ int main()
 {
     myen::Myen _myen{myen::MyenConfig{}};
     auto model = _myen.importGlftFile("/home/orvergon/myen/assets/obj/monke/monke.glb");
-    auto entityId = _myen.createEntity(model, glm::vec3(2.0f), {.frontFace = common::FrontFace::CounterClockwise, .cullMode = common::CullMode::Front});
+    auto entityId = _myen.createEntity(model, glm::vec3(2.0f), {
+	    .frontFace = common::FrontFace::CounterClockwise,
+	    .cullMode = common::CullMode::Front,
+	    .specializationConstants = {{common::ShaderConstant::LightCount, 2}},
+	});
     auto entity2Id = _myen.createEntity(model, glm::vec3(0.0f),
 					{
-					    .vertexShaderPath   = "/home/orvergon/myen/assets/white-shader/vert",
-					    .fragmentShaderPath = "/home/orvergon/myen/assets/white-shader/frag",
+					    .vertexShaderPath   = MYEN_SHADER_DIR "/white-shader/vert",
+					    .fragmentShaderPath = MYEN_SHADER_DIR "/white-shader/frag",
 					});
     auto entity1 = _myen.getEntity(entityId);
     auto entity2 = _myen.getEntity(entity2Id);
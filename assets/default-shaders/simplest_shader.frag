@@ -15,10 +15,15 @@ layout(set = 0, binding = 0) uniform FrameUniform{
     mat4 proj;
     mat4 view;
     vec4 globalLightColor;
-    Light lights[];
+    Light lights[10];
     uint lightsCount;
 }frameUniform;
 
+//Set per pipeline with common::PipelineCreateInfo::specializationConstants
+layout(constant_id = 0) const uint LIGHT_COUNT = 1;
+layout(constant_id = 1) const bool TEXTURE_ENABLED = true;
+layout(constant_id = 2) const bool SPECULAR_ENABLED = true;
+
 layout(set = 0, binding = 2) uniform sampler2D texSampler;
 
 layout(location = 0) out vec4 outColor;
@@ -29,17 +34,23 @@ void main() {
     vec3 ambient = ambientStrength * lightColor;
 
     vec3 normalizedNormal = normalize(normal);
-    vec3 lightDir = normalize(frameUniform.lights[1].lightPosition.xyz - fragPos);
-    float diff = max(dot(normalizedNormal, lightDir), 0.0);
-    vec3 diffuse = diff * frameUniform.lights[1].lightColor.xyz; 
-
-    float specularStrength = 0.9;
     vec3 cameraDir = normalize(frameUniform.cameraPos.xyz - fragPos);
-    vec3 reflectDir = reflect(-lightDir, normal);
-    float spec = pow(max(dot(cameraDir, reflectDir), 0.0), 256);
-    vec3 specular = specularStrength * spec * frameUniform.lights[1].lightColor.xyz;
-    
-    vec3 objColor = texture(texSampler, texCoord).xyz;
-    outColor = vec4((ambient + diffuse + specular) * objColor, 1.0);
-    //outColor = vec4(frameUniform.lights[1].lightPosition.xyz, 1.0);
+    float specularStrength = 0.9;
+
+    //LIGHT_COUNT is known when the pipeline is built, so this loop is unrolled
+    vec3 lighting = ambient;
+    for(uint i = 0; i < LIGHT_COUNT; i++){
+        vec3 lightDir = normalize(frameUniform.lights[i].lightPosition.xyz - fragPos);
+        float diff = max(dot(normalizedNormal, lightDir), 0.0);
+        lighting += diff * frameUniform.lights[i].lightColor.xyz;
+
+        if(SPECULAR_ENABLED){
+            vec3 reflectDir = reflect(-lightDir, normalizedNormal);
+            float spec = pow(max(dot(cameraDir, reflectDir), 0.0), 256);
+            lighting += specularStrength * spec * frameUniform.lights[i].lightColor.xyz;
+        }
+    }
+
+    vec3 objColor = TEXTURE_ENABLED ? texture(texSampler, texCoord).xyz : vec3(1.0);
+    outColor = vec4(lighting * objColor, 1.0);
 }
@@ -10,13 +10,20 @@ layout(set = 0, binding = 0) uniform FrameUniform{
     mat4 proj;
     mat4 view;
     vec4 globalLightColor;
+    Light lights[10];
     uint lightsCount;
-    Light lights[];
 }frameUniform;
 
-layout(set = 0, binding = 1) uniform ObjectUniform{
+struct InstanceData{
     mat4 model;
-}objUniform;
+    vec4 normalMatrix[3];
+    uint materialIndex;
+};
+
+//Every copy of the same mesh and material is one instanced draw
+layout(std430, set = 0, binding = 3) readonly buffer Instances{
+    InstanceData instances[];
+};
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
@@ -28,14 +35,16 @@ layout(location = 2) out vec3 outNormal;
 layout(location = 3) out vec3 outFragPos;
 
 void main() {
-    gl_Position = frameUniform.proj * frameUniform.view * objUniform.model * vec4(inPosition, 1.0);
+    InstanceData instance = instances[gl_InstanceIndex];
+    gl_Position = frameUniform.proj * frameUniform.view * instance.model * vec4(inPosition, 1.0);
 
     outFragColor = frameUniform.cameraPos.xyz;
     outTexCoord = inTexCoord;
-    outFragPos = vec3(objUniform.model * vec4(inPosition, 1.0));
+    outFragPos = vec3(instance.model * vec4(inPosition, 1.0));
 
-    //See https://learnopengl.com/Lighting/Basic-Lighting "One last thing"
-    //XXX: this matrices transformations should be done on the application
-    //and passed to the vertex as a separated matrix since this is costly
-    outNormal = mat3(transpose(inverse(objUniform.model))) * inNormal;
+    //Normal matrix comes from the application
+    mat3 normalMatrix = mat3(instance.normalMatrix[0].xyz,
+                             instance.normalMatrix[1].xyz,
+                             instance.normalMatrix[2].xyz);
+    outNormal = normalMatrix * inNormal;
 }
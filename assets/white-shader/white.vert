@@ -10,13 +10,15 @@ layout(set = 0, binding = 0) uniform FrameUniform{
     mat4 proj;
     mat4 view;
     vec4 globalLightColor;
+    Light lights[10];
     uint lightsCount;
-    Light lights[];
 }frameUniform;
 
-layout(set = 0, binding = 1) uniform ObjectUniform{
+layout(push_constant) uniform ObjectConstants{
     mat4 model;
-}objUniform;
+    vec4 normalMatrix[3];
+    uint materialIndex;
+}objConstants;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
@@ -28,14 +30,15 @@ layout(location = 2) out vec3 outNormal;
 layout(location = 3) out vec3 outFragPos;
 
 void main() {
-    gl_Position = frameUniform.proj * frameUniform.view * objUniform.model * vec4(inPosition, 1.0);
+    gl_Position = frameUniform.proj * frameUniform.view * objConstants.model * vec4(inPosition, 1.0);
 
     outFragColor = frameUniform.cameraPos.xyz;
     outTexCoord = inTexCoord;
-    outFragPos = vec3(objUniform.model * vec4(inPosition, 1.0));
+    outFragPos = vec3(objConstants.model * vec4(inPosition, 1.0));
 
-    //See https://learnopengl.com/Lighting/Basic-Lighting "One last thing"
-    //XXX: this matrices transformations should be done on the application
-    //and passed to the vertex as a separated matrix since this is costly
-    outNormal = mat3(transpose(inverse(objUniform.model))) * inNormal;
+    //Normal matrix comes from the application
+    mat3 normalMatrix = mat3(objConstants.normalMatrix[0].xyz,
+                             objConstants.normalMatrix[1].xyz,
+                             objConstants.normalMatrix[2].xyz);
+    outNormal = normalMatrix * inNormal;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <map>
 #include <vector>
 #include <string>
 #include <vulkan/vulkan.hpp>
@@ -12,9 +13,18 @@ struct Vertex{
     glm::vec2 texCoord;
 };
 
+//Range of Mesh::indices drawn for one level of detail, level 0 is the full mesh
+struct MeshLod{
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    float error; //how far the surface moved, relative to the mesh extent
+};
+
 struct Mesh{
     std::vector<uint32_t> indices;
     std::vector<Vertex> vertices;
+    //Empty for a single level, otherwise every level indexes the same vertices
+    std::vector<MeshLod> lods;
 };
 
 struct Model {
@@ -59,11 +69,20 @@ enum CullMode{
     None = (int) vk::CullModeFlagBits::eNone,
 };
 
+//constant_id of the specialization constants declared by the default shaders
+enum class ShaderConstant : uint32_t {
+    LightCount = 0,
+    TextureEnabled = 1,
+    SpecularEnabled = 2,
+};
+
 struct PipelineCreateInfo {
     common::FrontFace frontFace = FrontFace::Clockwise;
     common::CullMode cullMode = CullMode::Back;
-    std::string vertexShaderPath = "/home/orvergon/myen/assets/default-shaders/vert";
-    std::string fragmentShaderPath = "/home/orvergon/myen/assets/default-shaders/frag";
+    std::string vertexShaderPath = MYEN_SHADER_DIR "/default-shaders/vert";
+    std::string fragmentShaderPath = MYEN_SHADER_DIR "/default-shaders/frag";
+    //Each different set of values is its own pipeline, constants not set keep the shader default
+    std::map<ShaderConstant, uint32_t> specializationConstants;
 };
 
 }
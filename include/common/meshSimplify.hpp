@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "common/common.hpp"
+
+namespace common{
+
+/*
+  Quadric error edge collapse (Garland & Heckbert). Vertices are only dropped, never
+  moved, so every level indexes the same vertex list. Edges used by a single triangle
+  can't be collapsed, which keeps the borders and the uv seams in place.
+  Stops at targetIndexCount or when a collapse would move the surface more than
+  maxError (relative to the mesh extent). error gets the largest one that was done.
+ */
+std::vector<uint32_t> simplifyMesh(const std::vector<Vertex>& vertices,
+                                   const std::vector<uint32_t>& indices,
+                                   size_t targetIndexCount,
+                                   float maxError,
+                                   float* error = nullptr);
+
+//Appends up to maxLods - 1 simplified levels to mesh.indices, each about half the
+//previous one, and fills mesh.lods
+void generateLods(Mesh& mesh, uint32_t maxLods = 4);
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace common{
+
+/*
+  Fixed number of worker threads eating from a single task queue.
+  The destructor finishes everything that was already submitted.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned int threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+    void submit(std::function<void(void)> task);
+    //Splits [0, count) in chunks of grain, the calling thread works too and returns when all are done
+    void parallelFor(size_t count, size_t grain, std::function<void(size_t begin, size_t end)> function);
+    unsigned int size();
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void(void)>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void workerLoop();
+};
+
+}
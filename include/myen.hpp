@@ -39,6 +39,8 @@ struct Entity {
     std::optional<RenderBackend::ModelId> modelId; //Isso não deveria ser publico
     //precisa ter um modelId? porque eu não crio um ID de entidade e uso ele
     //como id do model no render?
+    std::optional<ModelId> asset; //imported model it was created from
+    bool isStatic = false; //set before buildHlods to let it merge the entity, moving it drops its cluster
 };
 
 //Why does common::Camera exist?
@@ -69,9 +71,13 @@ public:
     ~Myen();
 
     bool nextFrame();
-    ModelId importGlftFile(std::string gltf_path);
+    //Occluder models hide what is behind them in the cpu occlusion culling
+    ModelId importGlftFile(std::string gltf_path, bool occluder = false);
     EntityId createEntity(ModelId model, glm::vec3 pos = glm::vec3(0.0f), common::PipelineCreateInfo shaderInfo = {});
     EntityId createLight(glm::vec3 pos = glm::vec3(0.0f), glm::vec3 color = glm::vec3(1.0f));
+    //Clusters the entities marked isStatic on a grid and bakes one simplified proxy per
+    //cluster, drawn instead of them past distance. Call once the static scene is created.
+    void buildHlods(float cellSize = 20.0f, float distance = 60.0f);
     Entity* getEntity(EntityId id);
     bool keyPressed(std::string key);
     void addUICommands(std::string windowName, std::function<void(void)> function);
@@ -0,0 +1,54 @@
+/*************************************************************************************
+ * @file culling.hpp
+ * @brief Bounding volumes and SIMD frustum culling.
+ ************************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "common/common.hpp"
+
+namespace RenderBackend {
+
+//Object space bounds of a mesh, the sphere is centered on the AABB
+struct Bounds {
+    glm::vec3 center;
+    float radius;
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+Bounds computeBounds(const std::vector<common::Vertex>& vertices);
+
+//Planes point inwards and are normalized, dot(plane.xyz, p) + plane.w is the signed distance
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+//Works for both [0, 1] and [-1, 1] clip depth, the near plane is the looser one
+Frustum extractFrustum(const glm::mat4& viewProjection);
+
+/*
+  World space spheres stored as structure of arrays, so the test loads
+  4 (SSE) or 8 (AVX) of them in one go.
+ */
+struct SphereList {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    void clear();
+    void push(glm::vec3 center, float sphereRadius);
+    size_t size() const;
+};
+
+//visible[i] is 1 when sphere i touches the frustum, 0 otherwise. Only [begin, end) is
+//written so ranges can be culled on different threads.
+void cullSpheres(const Frustum& frustum, const SphereList& spheres, size_t begin, size_t end, uint8_t* visible);
+
+}
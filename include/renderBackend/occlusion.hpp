@@ -0,0 +1,73 @@
+/*************************************************************************************
+ * @file occlusion.hpp
+ * @brief Low resolution software depth buffer for occlusion culling on the cpu.
+ ************************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "common/common.hpp"
+
+namespace RenderBackend {
+
+//Object space triangles of a mesh flagged as occluder, only positions are kept
+struct OccluderMesh {
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> indices;
+};
+
+OccluderMesh makeOccluderMesh(const common::Mesh& mesh);
+
+/*
+  Occluders are drawn with their ndc depth, keeping the nearest one, and boxes
+  are then tested against it. Rows are rasterized 4 pixels at a time with SSE.
+  Triangles are set up once per frame and every band of rows is rasterized on
+  its own, so bands can go to different threads without sharing pixels.
+ */
+class OcclusionBuffer {
+public:
+    OcclusionBuffer(uint32_t width, uint32_t height);
+
+    //Clears the depth and the triangles of the previous frame
+    void begin(const glm::mat4& viewProjection);
+    //Triangles crossing the near plane are dropped, the buffer only misses occlusion then
+    void addOccluder(const OccluderMesh& mesh, const glm::mat4& model);
+    //Rows [firstRow, lastRow), call once the occluders of the frame were added
+    void rasterize(uint32_t firstRow, uint32_t lastRow);
+    //World space box, true when it is behind the occluders on every pixel it covers
+    bool isOccluded(glm::vec3 min, glm::vec3 max) const;
+
+    uint32_t getWidth() const;
+    uint32_t getHeight() const;
+    size_t getTriangleCount() const;
+
+private:
+    //Edge functions and depth plane in pixels, evaluated at pixel centers
+    struct Triangle {
+	glm::vec3 edgeX;
+	glm::vec3 edgeY;
+	glm::vec3 edgeOffset;
+	float depthX;
+	float depthY;
+	float depthOffset;
+	int32_t minX;
+	int32_t maxX;
+	int32_t minY;
+	int32_t maxY;
+    };
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; //width rounded up to a whole SSE register
+    std::vector<float> depth;
+    glm::mat4 viewProjection;
+    std::vector<Triangle> triangles;
+
+    void rasterizeRow(const Triangle& triangle, int32_t y, int32_t minX, int32_t maxX);
+};
+
+}
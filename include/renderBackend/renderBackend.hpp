@@ -6,11 +6,16 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <map>
 #include <sys/types.h>
 #include <unordered_map>
 #include <vector>
 #include <stack>
+#include <mutex>
+#include <set>
+#include <deque>
 #include <optional>
 #define VULKAN_HPP_NO_CONSTRUCTORS
 #include <vulkan/vulkan.hpp>
@@ -19,6 +24,10 @@
 #include <vulkan/vulkan_structs.hpp>
 
 #include "common/common.hpp"
+#include "common/threadPool.hpp"
+#include "renderBackend/spirvReflect.hpp"
+#include "renderBackend/culling.hpp"
+#include "renderBackend/occlusion.hpp"
 
 namespace RenderBackend {
 
@@ -28,12 +37,15 @@ enum BufferType
     eIndexBuffer,
     eStageBuffer,
     eUniformBuffer,
+    eStorageBuffer,
+    eIndirectBuffer,
 };
 
 enum ImageType
 {
     eDepth,
     eTexture,
+    eDepthPyramid, //farthest depth per texel, with every mip level
 };
 
 typedef uint64_t BufferId;
@@ -46,6 +58,8 @@ public:
     void setPool(int poolNumber);
     vk::CommandBuffer BeginSingleTimeCommand();
     void EndSingleTimeCommand(vk::CommandBuffer commandBuffer, bool wait);
+    void EndSingleTimeCommand(vk::CommandBuffer commandBuffer, vk::Fence fence);
+    void freeSingleTimeCommand(vk::CommandBuffer commandBuffer);
     std::vector<BufferId> allocateCommandBuffers(int noBuffers);
     vk::CommandBuffer beginCommand(BufferId bufferId);
     void endCommand(vk::CommandBuffer buffer,
@@ -64,6 +78,179 @@ private:
 };
 
 
+/*
+  A range inside one of the allocator blocks.
+  Buffers and images don't own a vk::DeviceMemory anymore, they own one of these.
+ */
+struct Allocation
+{
+    uint32_t poolId;
+    uint32_t blockIndex;
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset;
+    vk::DeviceSize size;
+    void* mapped; //nullptr when the memory isn't host visible
+};
+
+struct AllocatorStats
+{
+    uint64_t deviceAllocations; //live vkAllocateMemory calls
+    uint64_t subAllocations;
+    vk::DeviceSize reservedBytes; //sum of all the blocks
+    vk::DeviceSize usedBytes; //sum of the (power of 2 rounded) sub allocations
+    vk::DeviceSize requestedBytes;
+};
+
+/*
+  Block based allocator. Each memory type has two pools (linear resources and
+  optimal tiled images, so bufferImageGranularity is never a problem) and each
+  pool is a list of big vk::DeviceMemory blocks sub allocated with a buddy allocator.
+  Requests bigger than a block get a dedicated block.
+  Host visible blocks are mapped once when created and stay mapped.
+ */
+class MemoryAllocator
+{
+public:
+    MemoryAllocator(vk::Device device, vk::PhysicalDevice physicalDevice);
+    ~MemoryAllocator();
+    Allocation allocate(vk::MemoryRequirements requirements, vk::MemoryPropertyFlags properties, bool linear);
+    void free(Allocation allocation);
+    AllocatorStats getStats();
+
+private:
+    struct Block {
+	vk::DeviceMemory memory;
+	vk::DeviceSize size;
+	bool dedicated;
+	char* mapped;
+	uint32_t maxOrder;
+	std::vector<std::set<vk::DeviceSize>> freeLists; //one per order, offsets sorted
+	std::unordered_map<vk::DeviceSize, uint32_t> usedOrders; //offset -> order
+    };
+    struct Pool {
+	uint32_t memoryTypeIndex;
+	vk::DeviceSize blockSize;
+	std::vector<Block> blocks;
+    };
+
+    vk::Device device;
+    vk::PhysicalDevice physicalDevice;
+    vk::PhysicalDeviceMemoryProperties memoryProperties;
+    std::unordered_map<uint32_t, Pool> pools;
+    AllocatorStats stats{};
+
+    uint32_t createBlock(Pool& pool, vk::DeviceSize size, bool dedicated);
+    std::optional<vk::DeviceSize> allocateFromBlock(Block& block, uint32_t order);
+    void freeFromBlock(Block& block, vk::DeviceSize offset);
+};
+
+
+typedef uint64_t UploadTicket;
+
+/*
+  Fixed size ring of staging memory. It only hands out offsets, the memory itself
+  is a stage buffer owned by the ResourceManager. Ranges are given back to the
+  ring once the upload batch that used them is done.
+ */
+class StagingRing
+{
+public:
+    StagingRing(vk::DeviceSize capacity);
+    //nullopt means there is no space until some batch is released
+    std::optional<vk::DeviceSize> allocate(vk::DeviceSize size, vk::DeviceSize alignment);
+    //Everything allocated since the last call is owned by this ticket
+    void submitted(UploadTicket ticket);
+    void release(UploadTicket completedTicket);
+    vk::DeviceSize getCapacity();
+
+private:
+    struct Submission {
+	UploadTicket ticket;
+	vk::DeviceSize end;
+	vk::DeviceSize bytes;
+    };
+
+    vk::DeviceSize capacity;
+    vk::DeviceSize head = 0;
+    vk::DeviceSize tail = 0;
+    vk::DeviceSize used = 0;
+    vk::DeviceSize pending = 0;
+    std::deque<Submission> submissions;
+};
+
+
+/*
+  Records copies and layout transitions of many uploads in the same command buffer.
+  flush() submits the batch with a fence and each batch gets a ticket, a ticket is
+  ready once the fence of its batch (and all the previous ones) signaled.
+  Ticket 0 is always ready.
+ */
+class UploadBatcher
+{
+public:
+    UploadBatcher(vk::Device device, Commands* commands);
+    ~UploadBatcher();
+    vk::CommandBuffer record();
+    UploadTicket getRecordingTicket();
+    UploadTicket getCompletedTicket();
+    bool hasRecordedWork();
+    UploadTicket flush();
+    void poll();
+    bool waitOldest();
+
+private:
+    struct Batch {
+	UploadTicket ticket;
+	vk::CommandBuffer commandBuffer;
+	vk::Fence fence;
+    };
+
+    vk::Device device;
+    Commands* commands;
+    std::optional<vk::CommandBuffer> recording;
+    UploadTicket nextTicket = 1;
+    UploadTicket completedTicket = 0;
+    std::deque<Batch> inFlight;
+    std::vector<vk::Fence> freeFences;
+
+    void retire();
+};
+
+
+/*
+  Host visible buffer that is always mapped, writing to it is just a store.
+ */
+template<typename T>
+struct TypedBuffer
+{
+    BufferId id;
+    vk::Buffer buffer;
+    T* data;
+    size_t count;
+
+    T* operator->() { return data; }
+    T& operator[](size_t index) { return data[index]; }
+    void write(const T& value, size_t index = 0) { data[index] = value; }
+    vk::DescriptorBufferInfo getDescriptorInfo(size_t index = 0)
+    {
+        return vk::DescriptorBufferInfo{
+            .buffer = buffer,
+            .offset = index * sizeof(T),
+            .range = sizeof(T),
+        };
+    }
+    //The whole buffer, for storage buffers read as arrays
+    vk::DescriptorBufferInfo getArrayDescriptorInfo()
+    {
+        return vk::DescriptorBufferInfo{
+            .buffer = buffer,
+            .offset = 0,
+            .range = sizeof(T) * count,
+        };
+    }
+};
+
+
 class ResourceManager
 {
 public:
@@ -72,26 +259,200 @@ public:
 		    Commands* commands);
     ~ResourceManager();
     BufferId createBuffer(BufferType type, vk::DeviceSize size);
-    void insertDataBuffer(BufferId id, vk::DeviceSize size, void* data);
-    void copyBuffers(BufferId source, BufferId destination, vk::DeviceSize size);
+    void destroyBuffer(BufferId id);
+    void insertDataBuffer(BufferId id, vk::DeviceSize size, void* data, vk::DeviceSize offset = 0);
+    UploadTicket copyBuffers(BufferId source, BufferId destination, vk::DeviceSize size);
+    UploadTicket copyBufferRegions(BufferId source, BufferId destination, const std::vector<vk::BufferCopy>& regions);
+    UploadTicket uploadBuffer(BufferId destination, vk::DeviceSize size, void* data, vk::DeviceSize offset = 0);
     vk::Buffer getBuffer(BufferId id);
+    Allocation getBufferAllocation(BufferId id);
 
     ImageId createImage(vk::Extent2D size, ImageType type);
-    void transitionImage(ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout);
-    void copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size);
+    void destroyImage(ImageId id);
+    UploadTicket transitionImage(ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout);
+    UploadTicket copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size);
+    UploadTicket copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size, vk::DeviceSize bufferOffset);
+    UploadTicket uploadImage(ImageId imageId, vk::Extent2D size, vk::DeviceSize dataSize, void* data);
     vk::ImageView getImageView(ImageId imageId);
+    //View of a single mip level, only images created with more than one level have them
+    vk::ImageView getImageMipView(ImageId imageId, uint32_t level);
+    Allocation getImageAllocation(ImageId id);
+
+    template<typename T>
+    TypedBuffer<T> createTypedBuffer(BufferType type, size_t count = 1)
+    {
+        auto id = createBuffer(type, sizeof(T) * count);
+        return TypedBuffer<T>{
+            .id = id,
+            .buffer = buffers[id],
+            .data = static_cast<T*>(bufferAllocations[id].mapped),
+            .count = count,
+        };
+    }
+
+    AllocatorStats getAllocatorStats();
+    void flushUploads();
+    bool isUploaded(UploadTicket ticket);
+    //Blocks until the ticket is done, only for rare events like growing a buffer
+    void waitUpload(UploadTicket ticket);
     
 private:
     vk::Device device;
     vk::PhysicalDevice physicalDevice;
     Commands* commands;
+    MemoryAllocator* allocator;
+    StagingRing* stagingRing;
+    UploadBatcher* uploadBatcher;
+    BufferId stagingBuffer;
 
     std::unordered_map<BufferId, vk::Buffer> buffers;
-    std::unordered_map<BufferId, vk::DeviceMemory> bufferMemories;
+    std::unordered_map<BufferId, Allocation> bufferAllocations;
     std::unordered_map<BufferId, vk::DeviceSize> bufferSizes;
-    std::unordered_map<ImageId, vk::DeviceMemory> imageMemories;
+    std::unordered_map<ImageId, Allocation> imageAllocations;
     std::unordered_map<ImageId, vk::Image> images;
     std::unordered_map<ImageId, vk::ImageView> imageViews;
+    std::unordered_map<ImageId, std::vector<vk::ImageView>> imageMipViews;
+
+    vk::DeviceSize stage(vk::DeviceSize size, void* data);
+    void recordImageTransition(vk::CommandBuffer commandBuffer, ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout);
+};
+
+
+/*
+  Per frame bump allocator for small uniform data (eg. ObjectUniform).
+  There is one buffer per frame in flight that is reset when the frame starts,
+  data pushed to it is bound through eUniformBufferDynamic descriptors.
+ */
+class UniformRing
+{
+public:
+    UniformRing(ResourceManager* resourceManager, vk::DeviceSize frameSize, vk::DeviceSize alignment, uint32_t frames);
+    void beginFrame(uint32_t frame);
+    //Returns the dynamic offset of the data, nullopt when the ring is full
+    std::optional<uint32_t> allocate(vk::DeviceSize size);
+    vk::Buffer getBuffer(uint32_t frame);
+    vk::DeviceSize getUsedBytes();
+
+    template<typename T>
+    std::optional<uint32_t> push(const T& value)
+    {
+        auto offset = allocate(sizeof(T));
+        if(offset.has_value())
+            std::memcpy(buffers[frame].data + offset.value(), &value, sizeof(T));
+        return offset;
+    }
+
+private:
+    std::vector<TypedBuffer<char>> buffers;
+    vk::DeviceSize frameSize;
+    vk::DeviceSize alignment;
+    vk::DeviceSize head = 0;
+    uint32_t frame = 0;
+};
+
+
+/*
+  First fit allocator of ranges inside something of fixed capacity, it doesn't
+  own any memory. Free ranges are kept sorted by offset so neighbours are merged
+  when freed. Units are whatever the caller uses (vertices, indices...).
+ */
+class RangeAllocator
+{
+public:
+    RangeAllocator(uint64_t capacity = 0);
+    std::optional<uint64_t> allocate(uint64_t size);
+    void free(uint64_t offset, uint64_t size);
+    uint64_t getCapacity();
+    uint64_t getUsed();
+    //Free space that isn't at the end, what compaction would give back
+    uint64_t getFragmented();
+
+private:
+    uint64_t capacity;
+    uint64_t used = 0;
+    std::map<uint64_t, uint64_t> freeRanges; //offset -> size
+};
+
+
+typedef uint64_t GeometryId;
+struct GeometryRange {
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+};
+
+struct GeometryStats {
+    uint64_t vertexCapacity;
+    uint64_t vertexUsed;
+    uint64_t indexCapacity;
+    uint64_t indexUsed;
+    uint64_t compactions;
+    uint64_t generation;
+};
+
+/*
+  Every mesh lives in one shared vertex buffer and one shared index buffer, so
+  the geometry is bound once and any mesh is just a firstIndex/vertexOffset pair.
+  Removed ranges are reused once no frame in flight draws them anymore.
+  Removing meshes leaves holes, once they are big enough the live ranges are
+  copied packed into new buffers. The copy runs with the other uploads and the
+  old buffers are used until it is done, then kept until no frame in flight
+  reads them. The generation changes every time ranges move.
+ */
+class GeometryPool
+{
+public:
+    GeometryPool(ResourceManager* resourceManager, uint64_t vertexCapacity, uint64_t indexCapacity, uint32_t framesInFlight);
+    ~GeometryPool();
+    //The ticket is the upload of the mesh data
+    GeometryId add(common::Mesh* mesh, UploadTicket& uploadTicket);
+    void remove(GeometryId id);
+    GeometryRange getRange(GeometryId id);
+    vk::Buffer getVertexBuffer();
+    vk::Buffer getIndexBuffer();
+    void beginFrame(uint64_t frameNumber);
+    uint64_t getGeneration();
+    GeometryStats getStats();
+
+private:
+    struct Buffers {
+	BufferId vertexBuffer;
+	BufferId indexBuffer;
+	RangeAllocator vertices;
+	RangeAllocator indices;
+	std::unordered_map<GeometryId, GeometryRange> ranges;
+    };
+    struct Compaction {
+	Buffers buffers;
+	UploadTicket ticket;
+	std::vector<GeometryRange> freed; //removed while copying, freed once it is current
+    };
+    struct Retired {
+	BufferId vertexBuffer;
+	BufferId indexBuffer;
+	uint64_t frameNumber;
+    };
+    struct Freed {
+	GeometryRange range;
+	uint64_t frameNumber;
+    };
+
+    ResourceManager* resourceManager;
+    uint32_t framesInFlight;
+    uint64_t frameNumber = 0;
+    uint64_t generation = 0;
+    uint64_t compactions = 0;
+    Buffers current;
+    std::optional<Compaction> pending;
+    std::deque<Retired> retired;
+    std::deque<Freed> freed;
+
+    Buffers createBuffers(uint64_t vertexCapacity, uint64_t indexCapacity);
+    std::optional<GeometryRange> allocate(Buffers& buffers, uint64_t vertexCount, uint64_t indexCount);
+    UploadTicket upload(Buffers& buffers, GeometryRange range, common::Mesh* mesh);
+    void compact(uint64_t vertexCapacity, uint64_t indexCapacity);
+    void finishCompaction(bool wait);
 };
 
 
@@ -103,22 +464,44 @@ struct WriteDescriptorInfo{
     std::optional<vk::DescriptorImageInfo> imageInfo;
 };
 
+struct DescriptorStats{
+    uint64_t writesIssued;
+    uint64_t writesSkipped;
+    uint64_t updateCalls;
+    uint64_t pools;
+    uint64_t setsAllocated;
+};
+
+/*
+  updateDS/writeDS don't touch the descriptor sets right away. The contents of
+  every set are hashed, writes that don't change anything are dropped and the rest
+  is queued until flushUpdates() sends everything in a single vkUpdateDescriptorSets.
+
+  Layouts are deduplicated, creating a layout with the same bindings twice returns
+  the same DSLayoutId.
+
+  Sets come from a chain of pools, a new (bigger) pool is created when the current
+  one can't fit a batch. Sets are allocated in batches per layout and freed sets only
+  go back to the free list after the frames that could be using them retired.
+ */
 class DescriptorManager
 {
 public:
-    //TODO: Devia ter um helper pra criar o buffer e inserir logo o dado de uma vez.
-    //TODO: check brainstorm about typed buffers.
-    DescriptorManager(vk::Device device);
+    DescriptorManager(vk::Device device, uint32_t framesInFlight);
     DSLayoutId CreateLayout(std::vector<vk::DescriptorSetLayoutBinding> bindings);
     vk::DescriptorSetLayout getDSLayout(DSLayoutId ids);
+    std::vector<vk::DescriptorSetLayoutBinding> getLayoutBindings(DSLayoutId id);
     std::vector<vk::DescriptorSetLayout> getDSLayouts(std::vector<DSLayoutId> id);
     void preAllocateDescriptorSets(DSLayoutId id, uint32_t noSets);
     DSId getFreeDS(DSLayoutId id);
     DSId writeDS(DSLayoutId id, std::vector<WriteDescriptorInfo> writeInfos);
     void updateDS(DSId id, std::vector<WriteDescriptorInfo> writeInfos);
     void freeDS(DSId id);
+    void beginFrame(uint64_t frameNumber);
+    void flushUpdates();
     vk::DescriptorSet getDS(DSId id);
     vk::DescriptorPool getDescriptorPool();
+    DescriptorStats getStats();
 
 private:
     struct DescriptorSet{
@@ -132,9 +515,29 @@ private:
 	std::vector<vk::DescriptorSetLayoutBinding> bindings;
     };
 
+    struct PoolCapacity{
+	vk::DescriptorPool pool;
+	uint32_t sets;
+	std::map<vk::DescriptorType, uint32_t> descriptors;
+    };
+    struct RetiringSet{
+	DescriptorSet descriptor;
+	uint64_t frameNumber;
+    };
+
     vk::Device device;
-    vk::DescriptorPool pool;
+    uint32_t framesInFlight;
+    uint64_t frameNumber = 0;
+    vk::DescriptorPool imguiPool;
+    std::vector<PoolCapacity> pools;
+    uint32_t nextPoolSize;
     std::unordered_map<DSLayoutId, DescriptorSetLayout> layouts;
+    std::unordered_multimap<uint64_t, DSLayoutId> layoutsByHash;
+    std::deque<RetiringSet> retiringSets;
+
+    //Sized for layout too when given, so it always fits in a fresh pool
+    void createPool(uint32_t maxSets, const DescriptorSetLayout* layout = nullptr);
+    bool fits(PoolCapacity& pool, DescriptorSetLayout& layout, uint32_t noSets);
 
     /*
       get descriptor by id
@@ -143,6 +546,62 @@ private:
      */
     std::unordered_map<DSId, DescriptorSet> descriptors;
     std::unordered_map<DSLayoutId, std::stack<DescriptorSet>> freeDescriptorsByLayout;
+
+    std::unordered_map<DSId, uint64_t> contentHashes;
+    std::vector<vk::WriteDescriptorSet> pendingWrites;
+    //deques so the pointers in pendingWrites stay valid while new infos are queued
+    std::deque<vk::DescriptorBufferInfo> pendingBufferInfos;
+    std::deque<vk::DescriptorImageInfo> pendingImageInfos;
+    DescriptorStats stats{};
+};
+
+
+struct ShaderStats
+{
+    uint64_t filesMapped;
+    uint64_t modulesCreated;
+    uint64_t modulesReused;
+    uint64_t modulesDestroyed;
+    size_t bytesMapped;
+};
+
+/*
+ * Keeps one vk::ShaderModule per unique SPIR-V blob. Files are memory mapped
+ * and hashed only when they changed on disk since the last acquire, modules are
+ * reference counted and destroyed when the last pipeline using them releases it.
+ */
+class ShaderRegistry
+{
+public:
+    ShaderRegistry(vk::Device device);
+    vk::ShaderModule acquire(const std::string& path);
+    void release(vk::ShaderModule module);
+    //Cached until the file changes on disk
+    ShaderReflection reflect(const std::string& path);
+    ShaderStats getStats();
+
+private:
+    struct ShaderFile {
+	int64_t modifiedTime;
+	size_t size;
+	uint64_t contentHash;
+	ShaderReflection reflection;
+    };
+    struct ShaderModule {
+	vk::ShaderModule module;
+	uint32_t references;
+    };
+
+    vk::Device device;
+    //acquire is called by the pipeline compile threads
+    std::mutex mutex;
+    std::unordered_map<std::string, ShaderFile> files;
+    std::unordered_map<uint64_t, ShaderModule> modules;
+    std::unordered_map<VkShaderModule, uint64_t> hashesByModule;
+    ShaderStats stats{};
+
+    ShaderFile statFile(const std::string& path);
+    void mapFile(const std::string& path, ShaderFile& file, std::optional<vk::ShaderModule>* module);
 };
 
 
@@ -155,6 +614,22 @@ struct Pipeline
     vk::PipelineLayout pipelineLayout;
     vk::Sampler sampler;
     DSLayoutId descriptorLayout;
+    bool ready; //false while it is still compiling
+    vk::ShaderModule vertexShader;
+    vk::ShaderModule fragmentShader;
+    vk::ShaderModule computeShader;
+    //Set when the shaders take ObjectConstants as push constants
+    std::optional<vk::PushConstantRange> pushConstants;
+};
+
+struct PipelineStats
+{
+    uint64_t pipelinesCreated;
+    uint64_t pipelinesReused;
+    double compileMs;
+    uint64_t pipelinesReloaded;
+    bool cacheWarm;
+    size_t cacheBytesLoaded;
 };
 
 class PipelineManager
@@ -164,9 +639,10 @@ public:
 	common::PipelineCreateInfo pipelineCreateInfo;
 	std::string vertexShaderPath;
 	std::string fragmentShaderPath;
-	//this could be generated by analising the shader tho.
+	//see reflectShader
 	std::vector<vk::VertexInputBindingDescription> vertexBinds;
 	std::vector<vk::VertexInputAttributeDescription> vertexAttribs;
+	std::vector<vk::PushConstantRange> pushConstantRanges;
 	std::optional<vk::PipelineDepthStencilStateCreateInfo> depthStencilStateCreateInfo;
 	vk::Sampler sampler;
 
@@ -174,24 +650,101 @@ public:
 	std::optional<std::vector<DSLayoutId>> layoutIds;
     };
 
-    PipelineManager(vk::Device device, DescriptorManager* descriptorManager);
+    PipelineManager(vk::Device device, DescriptorManager* descriptorManager,
+                    common::ThreadPool* threadPool, uint32_t framesInFlight);
+    //Returns the existing pipeline when one was already created with the same info
     PipelineID CreatePipeline(PipelineInfo info);
+    //Same as CreatePipeline but returns right away, the pipeline is compiled by the
+    //thread pool. Layout, sampler and descriptorLayout can be used before it is ready.
+    PipelineID CreatePipelineAsync(PipelineInfo info);
+    //Compiled right away, the set 0 layout and push constants come from the shader.
+    //Not hot reloaded. Throws when the shader can't be read.
+    PipelineID CreateComputePipeline(const std::string& shaderPath);
     Pipeline getPipeline(PipelineID id);
+    bool isPipelineReady(PipelineID id);
+    //The caller makes sure the pipeline is no longer used by the gpu
+    void destroyPipeline(PipelineID id);
+    ShaderReflection reflectShader(const std::string& path);
+    //Swaps in pipelines rebuilt after their shaders changed on disk and
+    //destroys the replaced ones once the frames using them retired
+    void beginFrame(uint64_t frameNumber);
+    //The file is ignored when it was written by another device or driver version
+    void loadPipelineCache(const std::string& path, vk::PhysicalDeviceProperties properties);
+    void savePipelineCache();
+    vk::PipelineCache getPipelineCache();
+    PipelineStats getStats();
+    ShaderStats getShaderStats();
 
 private:
+    struct PipelineCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+	uint64_t dataHash;
+    };
+    struct PendingSwap{
+	PipelineID id;
+	uint64_t generation;
+	Pipeline pipeline;
+    };
+    struct RetiringPipeline{
+	Pipeline pipeline;
+	uint64_t frameNumber;
+    };
+    //The key is kept next to the layout so a hash collision can be told apart
+    struct CachedPipelineLayout{
+	std::vector<DSLayoutId> layoutIds;
+	std::vector<vk::PushConstantRange> pushConstantRanges;
+	vk::PipelineLayout layout;
+    };
+
     vk::Device device;
     DescriptorManager* descriptorManager;
+    common::ThreadPool* threadPool;
+    uint32_t framesInFlight;
+    ShaderRegistry* shaderRegistry;
+    //Guards pipelines and stats, they are written by the compile threads
+    std::mutex mutex;
+    vk::PipelineCache pipelineCache;
+    std::string pipelineCachePath;
+    PipelineCacheHeader cacheHeader{};
+    PipelineStats stats{};
+    PipelineID nextPipelineId = 0;
     std::unordered_map<PipelineID, Pipeline> pipelines;
+    std::unordered_multimap<uint64_t, PipelineID> pipelinesByHash;
+    std::unordered_multimap<uint64_t, CachedPipelineLayout> pipelineLayouts;
 
-    std::vector<char> readFile(const std::string& filename);
-    vk::ShaderModule compileShaderModule(const std::vector<char>& code);
-    
+    //Hot reload
+    int inotifyFd;
+    std::unordered_map<int, std::string> watchedDirectories;
+    std::unordered_map<std::string, int> watchesByDirectory;
+    std::unordered_map<std::string, std::set<PipelineID>> pipelinesByShader;
+    std::unordered_map<PipelineID, PipelineInfo> pipelineInfos;
+    std::unordered_map<PipelineID, uint64_t> rebuildGenerations;
+    std::vector<PendingSwap> pendingSwaps;
+    std::deque<RetiringPipeline> retiringPipelines;
+
+    uint64_t hashPipelineInfo(PipelineInfo& info);
+    //Pipeline created with the same info, compared in full since hashes can collide
+    std::optional<PipelineID> findPipeline(PipelineInfo& info, uint64_t pipelineHash);
+    vk::PipelineLayout getPipelineLayout(std::vector<DSLayoutId> layoutIds, std::vector<vk::PushConstantRange> pushConstantRanges);
+    PipelineID registerPipeline(PipelineInfo& info, uint64_t pipelineHash);
+    void buildPipeline(PipelineID id, PipelineInfo info);
+    std::optional<Pipeline> compilePipeline(PipelineInfo& info, Pipeline base);
+    void watchShader(const std::string& path, PipelineID id);
+    void pollShaderChanges();
+    void rebuildPipeline(PipelineID id, uint64_t generation);
 };
 
 
 struct Texture {
     ImageId image;
     vk::ImageView imageView;
+    UploadTicket uploadTicket;
 };
 
 typedef uint64_t LightId;
@@ -201,15 +754,67 @@ struct Light{
 };
 
 typedef uint64_t MeshId;
+//Offsets into the GeometryPool buffers, refreshed when the pool compacts
 struct Mesh {
-    BufferId vertexBufferId;
-    BufferId indexBufferId;
+    GeometryId geometry;
+    int32_t vertexOffset;
+    uint32_t firstIndex;
     uint64_t vertexCount;
     uint64_t indexCount;
+    Bounds bounds;
+    std::vector<common::MeshLod> lods; //index ranges relative to firstIndex, at least one
+    UploadTicket uploadTicket;
+};
+
+
+const uint32_t maxLights = 10;
+
+struct LightUniform {
+    glm::vec4 lightPosition;
+    glm::vec4 lightColor;
+};
+
+struct FrameUniform {
+    glm::vec4 cameraPosition;
+    glm::mat4 cameraProjection;
+    glm::mat4 cameraView;
+    glm::vec4 globalLightPosition;
+    LightUniform lights[maxLights];
+    uint lightsCount;
+};
+
+struct ObjectUniform {
+    glm::mat4 model;
+};
+
+//Per draw data for shaders with a push_constant block, has to fit the 128 bytes every device supports
+struct ObjectConstants {
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3]; //mat3 columns padded to vec4
+    uint32_t materialIndex;
+    uint32_t padding[3];
+};
+//Instanced shaders read the same data from a storage buffer with gl_InstanceIndex
+typedef ObjectConstants InstanceData;
+
+
+/*
+  Pipeline + texture pair. Its descriptor sets are written once when the
+  material is created, per object data comes from the UniformRing.
+ */
+typedef uint64_t MaterialId;
+struct Material {
+    MaterialId id;
+    PipelineID pipeline;
+    ImageId textureId;
+    DSId descriptors[2];
+    bool objectUniform; //the layout has the dynamic ObjectUniform binding
+    bool instanced; //the layout has the InstanceData storage buffer binding
 };
 
 
 typedef uint64_t ModelId;
+typedef uint64_t HlodId;
 struct Model {
     ModelId id;
     MeshId meshId;
@@ -220,11 +825,138 @@ struct Model {
     ImageId textureId;
 
     PipelineID pipeline;
-    
-    DSId descriptors[2];
-    BufferId uniformBuffers[2];
+    MaterialId material;
+    uint32_t lod = 0; //picked last frame, kept inside the hysteresis band
+    std::optional<HlodId> hlod; //cluster it belongs to, as a member or as the proxy
+    bool hlodProxy = false;
+};
+
+/*
+  Hierarchical LOD cluster, past distance the proxy (one merged and simplified mesh)
+  is drawn instead of every member. Members and proxies are always drawn through the
+  direct path, the indirect scene is only rebuilt when something changes.
+ */
+struct Hlod {
+    ModelId proxy;
+    std::vector<ModelId> members;
+    float distance;
+    bool proxyActive;
+};
+
+
+/*
+  Everything needed to record one draw, resolved once per frame so the recorder
+  doesn't touch any map. DrawPackets point to them and are what gets sorted.
+ */
+struct DrawItem {
+    vk::Pipeline pipeline;
+    vk::PipelineLayout pipelineLayout;
+    std::optional<vk::PushConstantRange> pushConstants;
+    vk::DescriptorSet descriptorSet;
+    std::optional<uint32_t> dynamicOffset;
+    vk::Buffer vertexBuffer;
+    vk::Buffer indexBuffer;
+    uint32_t indexCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t materialIndex;
+    bool instanced;
+    glm::mat4 model;
 };
 
+//key bits, high to low: pipeline(12) material(16) mesh(16) depth(20)
+struct DrawPacket {
+    uint64_t key;
+    uint32_t item;
+};
+
+//Consecutive indirect commands that share pipeline, material and buffers, one call draws them all
+struct IndirectBatch {
+    PipelineID pipeline;
+    MaterialId material;
+    vk::Buffer vertexBuffer;
+    vk::Buffer indexBuffer;
+    uint32_t firstCommand;
+    uint32_t commandCount;
+};
+
+//The following mirror the buffers and push constants of cull.comp
+struct CullObject {
+    glm::vec4 sphere; //world space center and radius
+    uint32_t command; //of level 0, level i is command + i
+    uint32_t lodCount;
+    uint32_t padding[2];
+};
+
+//Indirect command before culling, cull.comp fills instanceCount
+struct CullCommand {
+    vk::DrawIndexedIndirectCommand command;
+    uint32_t batch;
+    uint32_t batchFirstCommand;
+    uint32_t padding;
+};
+
+//std140, written once per frame
+struct CullUniform {
+    glm::vec4 frustumPlanes[6];
+    glm::mat4 viewProjection;
+    glm::mat4 pyramidViewProjection; //camera of the frame the depth pyramid was built from
+    glm::vec2 depthSize;
+    uint32_t pyramidLevels;
+    float lodBias;
+    glm::vec4 cameraPosition;
+    float projectionScale; //proj[1][1], screen size of a sphere is radius * projectionScale / distance
+    float lodReferenceSize;
+    float lodHysteresis;
+    uint32_t padding;
+};
+
+struct CullConstants {
+    uint32_t objectCount;
+    uint32_t commandCount;
+    uint32_t batchCount;
+    uint32_t pass;
+    uint32_t compactDraws;
+    uint32_t phase; //0 before the early render pass, 1 once the pyramid of this frame is built
+    uint32_t occlusion;
+};
+
+struct CullStats {
+    uint32_t visibleObjects;
+    uint32_t occludedObjects;
+};
+
+//Mirrors the push constants of hiz.comp
+struct PyramidConstants {
+    glm::ivec2 sourceSize;
+    glm::ivec2 destinationSize;
+};
+
+struct GpuFeatures {
+    bool multiDrawIndirect;
+    bool drawIndirectFirstInstance;
+    bool drawIndirectCount;
+    bool samplerAnisotropy;
+};
+
+struct RenderStats {
+    uint64_t drawCalls;
+    uint64_t indirectDraws;
+    uint64_t instancesDrawn;
+    uint64_t pipelineBinds;
+    uint64_t descriptorBinds;
+    uint64_t vertexBufferBinds;
+    uint64_t indexBufferBinds;
+    uint64_t objectsVisible;
+    uint64_t objectsCulled;
+    uint64_t objectsOccluded;
+    uint64_t occluderTriangles;
+    uint64_t trianglesDrawn;
+    uint64_t hlodProxies;
+    double cullMs;
+    double occlusionMs;
+    double recordMs;
+};
 
 class RenderBackend
 {
@@ -233,7 +965,10 @@ public:
     ~RenderBackend();
 
     void drawFrame();
-    MeshId addMesh(common::Mesh* mesh);
+    //Occluders are also drawn into the cpu occlusion buffer, meant for big and simple meshes
+    MeshId addMesh(common::Mesh* mesh, bool occluder = false);
+    //Models using the mesh are skipped from then on
+    void removeMesh(MeshId mesh);
     ImageId addTexture(common::Texture* texture);
     LightId addLight(glm::vec3 position, glm::vec3 color);
     ModelId addModel(MeshId mesh,
@@ -242,6 +977,11 @@ public:
 		     ImageId texture,
 		     PipelineID pipeline = 0);
     void updateModelPosition(ModelId model, glm::vec3 position, glm::vec3 rotation);
+    MaterialId getModelMaterial(ModelId model);
+    //Members have to share a material and stay still, the proxy vertices are relative to position
+    HlodId addHlod(const std::vector<ModelId>& members, common::Mesh* proxy, glm::vec3 position, float distance);
+    //Members are drawn on their own again, done when one of them moves
+    void removeHlod(HlodId hlod);
     void addUICommands(std::string windowName, std::function<void(void)> function);
     PipelineID createPipeline(common::PipelineCreateInfo createInfo);
     
@@ -256,7 +996,11 @@ private:
     Commands* commands;
     PipelineManager* pipelineManager;
     DescriptorManager* descriptorManager;
-    short mFrame = 0;
+    common::ThreadPool* threadPool;
+    UniformRing* uniformRing;
+    GeometryPool* geometryPool;
+    uint64_t geometryGeneration = 0;
+    uint64_t mFrame = 0;
 
     std::vector<vk::Fence> inFlightFences;
     std::vector<vk::Semaphore> imageAvailableSemaphores;
@@ -265,7 +1009,63 @@ private:
     std::unordered_map<MeshId, Mesh> meshes;
     std::unordered_map<MeshId, Texture> textures;
     std::unordered_map<ModelId, Model> models;
+    std::unordered_map<MaterialId, Material> materials;
+    std::map<std::pair<PipelineID, ImageId>, MaterialId> materialIds;
     std::unordered_map<LightId, Light> lights;
+    //Kept between frames so the queue doesn't allocate
+    std::vector<DrawItem> drawItems;
+    std::vector<DrawPacket> drawPackets;
+    std::vector<DrawPacket> drawPacketsScratch;
+    std::unordered_map<PipelineID, Pipeline> framePipelines;
+    RenderStats renderStats{};
+    //Frustum culling inputs, gathered every frame
+    bool frustumCulling = true;
+    std::vector<Model*> cullModels;
+    SphereList cullSphereList;
+    std::vector<uint8_t> cullVisible;
+    //Added to the level picked from the screen size, positive is coarser
+    float lodBias = 0.0f;
+    bool hlodEnabled = true;
+    std::unordered_map<HlodId, Hlod> hlods;
+    //CPU occlusion culling of the models that passed the frustum test
+    bool cpuOcclusion = false;
+    OcclusionBuffer* occlusionBuffer;
+    std::unordered_map<MeshId, OccluderMesh> occluderMeshes;
+
+    //GPU driven path, instanced models live in the instance and indirect buffers and
+    //are only written again when the scene changes
+    GpuFeatures gpuFeatures{};
+    PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount = nullptr;
+    bool gpuDriven = false;
+    uint32_t sceneDirtyFrames = 0;
+    std::vector<IndirectBatch> indirectBatches[2];
+    std::vector<ModelId> directModelIds; //models the GPU driven path can't draw
+    //GPU culling of the GPU driven path, off when cull.comp couldn't be loaded
+    bool gpuCulling = false;
+    std::optional<PipelineID> cullPipeline;
+    DSId cullDescriptors[2];
+    uint32_t sceneObjectCounts[2] = {};
+    uint32_t sceneCommandCounts[2] = {};
+    uint32_t sceneInstanceSlots[2] = {}; //used by the scene commands, direct draws go after them
+    bool cullDispatched[2] = {};
+    //Read back from the frame that last used the slot, so it is a couple of frames old
+    uint32_t gpuVisibleObjects = 0;
+    uint32_t gpuOccludedObjects = 0;
+    //Hi-Z occlusion culling, two phases: the early pass draws what passed against the
+    //pyramid of the previous frame, the pyramid is rebuilt from that depth and the late
+    //pass draws what the early phase rejected but is visible after all
+    bool occlusionCulling = false;
+    std::optional<PipelineID> pyramidPipeline;
+    ImageId depthImage;
+    ImageId depthPyramid;
+    vk::Extent2D pyramidSize;
+    uint32_t pyramidLevels = 0;
+    vk::Sampler pyramidSampler;
+    std::vector<DSId> pyramidDescriptors;
+    glm::mat4 pyramidViewProjection;
+    bool pyramidValid = false;
+    vk::RenderPass earlyRenderPass;
+    vk::RenderPass lateRenderPass;
     vk::Queue graphicsQueue;
     vk::Queue presentQueue;
     vk::RenderPass renderPass;
@@ -276,6 +1076,18 @@ private:
     vk::Sampler sampler;
 
     void createSampler();
+    MaterialId getMaterial(PipelineID pipeline, ImageId texture);
+    uint32_t selectLod(Model& model, const Mesh& mesh);
+    void buildDrawPackets(short frame);
+    void recordDrawPackets(vk::CommandBuffer commandBuffer, short frame);
+    void markSceneDirty();
+    void buildIndirectScene(short frame);
+    void recordIndirectBatches(vk::CommandBuffer commandBuffer, short frame);
+    void createCullPass();
+    void recordCullPass(vk::CommandBuffer commandBuffer, short frame, uint32_t phase);
+    void createDepthPyramid();
+    void recordDepthPyramid(vk::CommandBuffer commandBuffer);
+    bool occlusionActive();
 };
 
 }
@@ -0,0 +1,81 @@
+/*************************************************************************************
+ * @file spirvReflect.hpp
+ * @brief Minimal SPIR-V reflection, enough to build layouts and vertex input.
+ ************************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RenderBackend {
+
+//Values match VkShaderStageFlagBits so they can be or'ed into the layout bindings
+enum ShaderStageBits : uint32_t
+{
+    eStageVertex = 0x00000001,
+    eStageFragment = 0x00000010,
+    eStageCompute = 0x00000020,
+};
+
+enum class ReflectedDescriptorType
+{
+    eUniformBuffer,
+    eStorageBuffer,
+    eCombinedImageSampler,
+    eSampledImage,
+    eStorageImage,
+    eSampler,
+};
+
+enum class ReflectedBaseType
+{
+    eFloat,
+    eInt,
+    eUint,
+};
+
+struct ReflectedBinding
+{
+    uint32_t set;
+    uint32_t binding;
+    ReflectedDescriptorType type;
+    uint32_t count;
+    uint32_t size; //size of the block for buffers, 0 otherwise
+    std::string name;
+};
+
+struct ReflectedPushConstant
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct ReflectedVertexInput
+{
+    uint32_t location;
+    ReflectedBaseType baseType;
+    uint32_t components;
+    uint32_t width;
+    std::string name;
+};
+
+/*
+  Only what the entry point really touches is reported: resources and inputs that
+  are declared but never referenced by a function are left out, so the pipeline
+  doesn't bind descriptors or fetch attributes it does not need.
+ */
+struct ShaderReflection
+{
+    uint32_t stage;
+    std::vector<ReflectedBinding> bindings;
+    std::vector<ReflectedPushConstant> pushConstants;
+    std::vector<ReflectedVertexInput> vertexInputs;
+};
+
+//Throws std::runtime_error when the code is not SPIR-V
+ShaderReflection reflectSpirv(const uint32_t* code, size_t wordCount);
+
+}
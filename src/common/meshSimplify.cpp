@@ -0,0 +1,256 @@
+#include "common/meshSimplify.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace common{
+
+//Error allowed for the first simplified level, doubled for every next one
+const float lodBaseError = 0.01f;
+//A level has to drop at least 20% of the previous one to be kept
+const float lodMinReduction = 0.8f;
+
+//Sum of squared distances to a set of planes, weighted by triangle area
+struct Quadric{
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+    double weight;
+};
+
+static void addPlane(Quadric& quadric, glm::vec3 normal, float distance, float weight)
+{
+    double a = normal.x, b = normal.y, c = normal.z, d = distance;
+    quadric.a2 += weight * a * a;
+    quadric.ab += weight * a * b;
+    quadric.ac += weight * a * c;
+    quadric.ad += weight * a * d;
+    quadric.b2 += weight * b * b;
+    quadric.bc += weight * b * c;
+    quadric.bd += weight * b * d;
+    quadric.c2 += weight * c * c;
+    quadric.cd += weight * c * d;
+    quadric.d2 += weight * d * d;
+    quadric.weight += weight;
+}
+
+static void addQuadric(Quadric& quadric, const Quadric& other)
+{
+    quadric.a2 += other.a2;
+    quadric.ab += other.ab;
+    quadric.ac += other.ac;
+    quadric.ad += other.ad;
+    quadric.b2 += other.b2;
+    quadric.bc += other.bc;
+    quadric.bd += other.bd;
+    quadric.c2 += other.c2;
+    quadric.cd += other.cd;
+    quadric.d2 += other.d2;
+    quadric.weight += other.weight;
+}
+
+static double evaluate(const Quadric& quadric, glm::vec3 position)
+{
+    double x = position.x, y = position.y, z = position.z;
+    return quadric.a2 * x * x + 2 * quadric.ab * x * y + 2 * quadric.ac * x * z + 2 * quadric.ad * x
+         + quadric.b2 * y * y + 2 * quadric.bc * y * z + 2 * quadric.bd * y
+         + quadric.c2 * z * z + 2 * quadric.cd * z
+         + quadric.d2;
+}
+
+//Mean squared distance of the merged planes to where the vertex ends up
+static double collapseError(const Quadric& from, const Quadric& to, glm::vec3 position)
+{
+    double weight = from.weight + to.weight;
+    if(weight <= 0.0)
+        return 0.0;
+    return std::abs(evaluate(from, position) + evaluate(to, position)) / weight;
+}
+
+static bool contains(const uint32_t* triangle, uint32_t vertex)
+{
+    return triangle[0] == vertex || triangle[1] == vertex || triangle[2] == vertex;
+}
+
+std::vector<uint32_t> simplifyMesh(const std::vector<Vertex>& vertices,
+                                   const std::vector<uint32_t>& indices,
+                                   size_t targetIndexCount,
+                                   float maxError,
+                                   float* error)
+{
+    if(error)
+        *error = 0.0f;
+    std::vector<uint32_t> result = indices;
+    size_t triangleCount = indices.size() / 3;
+    size_t targetTriangles = targetIndexCount / 3;
+    if(triangleCount <= targetTriangles)
+        return result;
+
+    glm::vec3 min = vertices[indices[0]].pos;
+    glm::vec3 max = min;
+    for(auto index : indices){
+        min = glm::min(min, vertices[index].pos);
+        max = glm::max(max, vertices[index].pos);
+    }
+    float extent = glm::length(max - min);
+    if(extent <= 0.0f)
+        return result;
+    double errorLimit = double(maxError * extent) * double(maxError * extent);
+
+    //Triangles around each vertex, collapses only ever add to them
+    std::vector<std::vector<uint32_t>> vertexTriangles(vertices.size());
+    std::vector<Quadric> quadrics(vertices.size(), Quadric{});
+    std::unordered_map<uint64_t, uint32_t> edgeUses;
+    auto edgeKey = [](uint32_t a, uint32_t b){
+        return (uint64_t(std::min(a, b)) << 32) | std::max(a, b);
+    };
+    for(size_t triangle = 0; triangle < triangleCount; triangle++){
+        const uint32_t* corners = &result[triangle * 3];
+        for(int corner = 0; corner < 3; corner++){
+            vertexTriangles[corners[corner]].push_back(triangle);
+            edgeUses[edgeKey(corners[corner], corners[(corner + 1) % 3])]++;
+        }
+        glm::vec3 p0 = vertices[corners[0]].pos;
+        glm::vec3 normal = glm::cross(vertices[corners[1]].pos - p0, vertices[corners[2]].pos - p0);
+        float doubleArea = glm::length(normal);
+        if(doubleArea <= 0.0f)
+            continue;
+        normal /= doubleArea;
+        for(int corner = 0; corner < 3; corner++)
+            addPlane(quadrics[corners[corner]], normal, -glm::dot(normal, p0), doubleArea * 0.5f);
+    }
+    std::vector<uint8_t> locked(vertices.size(), 0);
+    for(auto& [key, uses] : edgeUses){
+        if(uses == 1){
+            locked[key >> 32] = 1;
+            locked[key & 0xffffffff] = 1;
+        }
+    }
+
+    //Moving from onto to must not turn any of the triangles that stay around
+    auto flips = [&](uint32_t from, uint32_t to, const std::vector<uint8_t>& removed){
+        glm::vec3 target = vertices[to].pos;
+        for(auto triangle : vertexTriangles[from]){
+            const uint32_t* corners = &result[triangle * 3];
+            if(removed[triangle] || !contains(corners, from) || contains(corners, to))
+                continue;
+            glm::vec3 before[3];
+            glm::vec3 after[3];
+            for(int corner = 0; corner < 3; corner++){
+                before[corner] = vertices[corners[corner]].pos;
+                after[corner] = corners[corner] == from ? target : before[corner];
+            }
+            glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+            glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+            if(glm::dot(normalBefore, normalAfter) <= 0.0f)
+                return true;
+        }
+        return false;
+    };
+
+    //Each pass sorts every possible collapse and does the cheap ones that don't
+    //share a vertex, the costs around a collapse are only right again next pass
+    struct Collapse{
+        uint32_t from;
+        uint32_t to;
+        double error;
+    };
+    std::vector<Collapse> collapses;
+    std::vector<uint8_t> removed(triangleCount, 0);
+    std::vector<uint8_t> touched(vertices.size(), 0);
+    size_t liveTriangles = triangleCount;
+    double largestError = 0.0;
+    while(liveTriangles > targetTriangles){
+        collapses.clear();
+        for(size_t triangle = 0; triangle < triangleCount; triangle++){
+            if(removed[triangle])
+                continue;
+            const uint32_t* corners = &result[triangle * 3];
+            for(int corner = 0; corner < 3; corner++){
+                uint32_t a = corners[corner];
+                uint32_t b = corners[(corner + 1) % 3];
+                if(!locked[a])
+                    collapses.push_back({a, b, collapseError(quadrics[a], quadrics[b], vertices[b].pos)});
+                if(!locked[b])
+                    collapses.push_back({b, a, collapseError(quadrics[b], quadrics[a], vertices[a].pos)});
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](auto& a, auto& b){
+            return a.error < b.error;
+        });
+
+        std::fill(touched.begin(), touched.end(), 0);
+        size_t collapsed = 0;
+        for(auto& collapse : collapses){
+            if(collapse.error > errorLimit || liveTriangles <= targetTriangles)
+                break;
+            if(touched[collapse.from] || touched[collapse.to] || flips(collapse.from, collapse.to, removed))
+                continue;
+
+            for(auto triangle : vertexTriangles[collapse.from]){
+                uint32_t* corners = &result[triangle * 3];
+                if(removed[triangle] || !contains(corners, collapse.from))
+                    continue;
+                //The collapsed edge, it has no area left
+                if(contains(corners, collapse.to)){
+                    removed[triangle] = 1;
+                    liveTriangles--;
+                    continue;
+                }
+                for(int corner = 0; corner < 3; corner++){
+                    if(corners[corner] == collapse.from)
+                        corners[corner] = collapse.to;
+                }
+                vertexTriangles[collapse.to].push_back(triangle);
+            }
+            addQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+            touched[collapse.from] = 1;
+            touched[collapse.to] = 1;
+            largestError = std::max(largestError, collapse.error);
+            collapsed++;
+        }
+        if(collapsed == 0)
+            break;
+    }
+
+    std::vector<uint32_t> simplified;
+    simplified.reserve(liveTriangles * 3);
+    for(size_t triangle = 0; triangle < triangleCount; triangle++){
+        if(!removed[triangle])
+            simplified.insert(simplified.end(), &result[triangle * 3], &result[triangle * 3] + 3);
+    }
+    if(error)
+        *error = static_cast<float>(std::sqrt(largestError)) / extent;
+    return simplified;
+}
+
+void generateLods(Mesh& mesh, uint32_t maxLods)
+{
+    mesh.lods.clear();
+    mesh.lods.push_back(MeshLod{
+        .firstIndex = 0,
+        .indexCount = static_cast<uint32_t>(mesh.indices.size()),
+        .error = 0.0f,
+    });
+    if(mesh.indices.empty())
+        return;
+
+    //Each level is simplified from the one before, not from the full mesh
+    std::vector<uint32_t> previous = mesh.indices;
+    float maxError = lodBaseError;
+    for(uint32_t lod = 1; lod < maxLods; lod++){
+        float error = 0.0f;
+        auto simplified = simplifyMesh(mesh.vertices, previous, previous.size() / 2, maxError, &error);
+        if(simplified.empty() || simplified.size() > previous.size() * lodMinReduction)
+            break;
+        mesh.lods.push_back(MeshLod{
+            .firstIndex = static_cast<uint32_t>(mesh.indices.size()),
+            .indexCount = static_cast<uint32_t>(simplified.size()),
+            .error = mesh.lods.back().error + error,
+        });
+        mesh.indices.insert(mesh.indices.end(), simplified.begin(), simplified.end());
+        previous = std::move(simplified);
+        maxError *= 2.0f;
+    }
+}
+
+}
@@ -0,0 +1,95 @@
+#include "common/threadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace common{
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+    //hardware_concurrency can return 0 when it doesn't know
+    threadCount = std::max(threadCount, 1u);
+    for(unsigned int i = 0; i < threadCount; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::submit(std::function<void(void)> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(task));
+    }
+    condition.notify_one();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, std::function<void(size_t begin, size_t end)> function)
+{
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = (count + grain - 1) / grain;
+    if(chunks <= 1){
+        if(count > 0)
+            function(0, count);
+        return;
+    }
+
+    //Workers may only pick their task after everything is done, so the state outlives this call
+    struct Job {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto job = std::make_shared<Job>();
+    auto run = [job, chunks, count, grain, function]{
+        size_t chunk;
+        while((chunk = job->next++) < chunks){
+            function(chunk * grain, std::min(count, (chunk + 1) * grain));
+            if(++job->done == chunks){
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->finished.notify_all();
+            }
+        }
+    };
+    size_t helpers = std::min<size_t>(workers.size(), chunks - 1);
+    for(size_t i = 0; i < helpers; i++)
+        submit(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&]{ return job->done == chunks; });
+}
+
+unsigned int ThreadPool::size()
+{
+    return workers.size();
+}
+
+void ThreadPool::workerLoop()
+{
+    while(true){
+        std::function<void(void)> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]{ return stopping || !tasks.empty(); });
+            if(tasks.empty())
+                return; //stopping and nothing left to do
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+}
@@ -2,6 +2,7 @@
 
 #include "GLFW/glfw3.h"
 #include "common.hpp"
+#include "common/meshSimplify.hpp"
 #include "stb_image.h"
 #include "window.hpp"
 #include "renderBackend.hpp"
@@ -14,6 +15,8 @@
 #include <chrono>
 #include <cstdint>
 #include <iterator>
+#include <map>
+#include <tuple>
 #include <sys/types.h>
 
 #include <string>
@@ -206,7 +209,7 @@ bool Myen::nextFrame() {
 }
 
 
-ModelId Myen::importGlftFile(std::string gltf_path) {
+ModelId Myen::importGlftFile(std::string gltf_path, bool occluder) {
     tinygltf::Model model;
     tinygltf::TinyGLTF loader;
     std::string err;
@@ -269,7 +272,9 @@ ModelId Myen::importGlftFile(std::string gltf_path) {
         printf("Failed to parse glTF\n");
     }
 
-    auto meshId = renderBackend->addMesh(&m);
+    //Simplified levels go after the full index list, the backend picks one by screen size
+    common::generateLods(m);
+    auto meshId = renderBackend->addMesh(&m, occluder);
     auto textureId = renderBackend->addTexture(&t);
     //auto modelId = renderBackend->addModel(meshId, glm::vec3(1.0f), glm::vec3(0.0f), &t);
     static ModelId id = 0;
@@ -294,6 +299,7 @@ EntityId Myen::createEntity(ModelId modelId, glm::vec3 pos, common::PipelineCrea
 	.type = Entity::Type::Graphical,
         .pos = pos,
 	.modelId = entityId,
+	.asset = modelId,
     };
     return nextEntityId++;
 }
@@ -308,6 +314,63 @@ EntityId Myen::createLight(glm::vec3 pos, glm::vec3 color)
     return nextEntityId++;
 }
 
+//Proxies keep a quarter of the triangles of their cluster
+const size_t hlodReduction = 4;
+//Relative to the cluster extent, proxies are only seen from far away
+const float hlodMaxError = 0.05f;
+
+void Myen::buildHlods(float cellSize, float distance)
+{
+    //Only entities that share a cell and a material can be merged into one draw
+    std::map<std::tuple<int, int, int, RenderBackend::MaterialId>, std::vector<Entity*>> clusters;
+    for(auto& [entityId, entity] : entities){
+        if(entity.type != Entity::Type::Graphical || !entity.isStatic || !entity.asset.has_value())
+            continue;
+        glm::ivec3 cell(glm::floor(entity.pos / cellSize));
+        auto material = renderBackend->getModelMaterial(entity.modelId.value());
+        clusters[{cell.x, cell.y, cell.z, material}].push_back(&entity);
+    }
+
+    for(auto& [key, members] : clusters){
+        //A single entity gains nothing from a proxy
+        if(members.size() < 2)
+            continue;
+        glm::vec3 center(0.0f);
+        for(auto entity : members)
+            center += entity->pos;
+        center /= static_cast<float>(members.size());
+
+        common::Mesh merged;
+        std::vector<RenderBackend::ModelId> modelIds;
+        for(auto entity : members){
+            auto& mesh = models[entity->asset.value()].mesh;
+            size_t indexCount = mesh.lods.empty() ? mesh.indices.size() : mesh.lods[0].indexCount;
+            uint32_t firstVertex = merged.vertices.size();
+            for(auto vertex : mesh.vertices){
+                vertex.pos += entity->pos - center;
+                merged.vertices.push_back(vertex);
+            }
+            for(size_t i = 0; i < indexCount; i++)
+                merged.indices.push_back(firstVertex + mesh.indices[i]);
+            modelIds.push_back(entity->modelId.value());
+        }
+
+        auto indices = common::simplifyMesh(merged.vertices, merged.indices,
+                                            merged.indices.size() / hlodReduction, hlodMaxError);
+        //Only the vertices the simplified triangles still use
+        common::Mesh proxy;
+        std::vector<uint32_t> remap(merged.vertices.size(), UINT32_MAX);
+        for(auto index : indices){
+            if(remap[index] == UINT32_MAX){
+                remap[index] = proxy.vertices.size();
+                proxy.vertices.push_back(merged.vertices[index]);
+            }
+            proxy.indices.push_back(remap[index]);
+        }
+        renderBackend->addHlod(modelIds, &proxy, center, distance);
+    }
+}
+
 Entity* Myen::getEntity(EntityId id) {
     return &entities[id];
 }
@@ -0,0 +1,159 @@
+/*************************************************************************************
+ * @file culling.cpp
+ * @brief Implementation of the bounding volumes and SIMD frustum culling.
+ ************************************************************************************/
+
+#include "renderBackend/culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CULLING_X86
+#endif
+
+namespace RenderBackend {
+
+Bounds computeBounds(const std::vector<common::Vertex>& vertices)
+{
+    if(vertices.empty())
+        return Bounds{};
+
+    glm::vec3 min = vertices[0].pos;
+    glm::vec3 max = vertices[0].pos;
+    for(auto& vertex : vertices){
+        min = glm::min(min, vertex.pos);
+        max = glm::max(max, vertex.pos);
+    }
+    //Farthest vertex from the AABB center, tighter than half the diagonal
+    glm::vec3 center = (min + max) * 0.5f;
+    float radiusSquared = 0.0f;
+    for(auto& vertex : vertices){
+        glm::vec3 offset = vertex.pos - center;
+        radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    return Bounds{
+        .center = center,
+        .radius = std::sqrt(radiusSquared),
+        .min = min,
+        .max = max,
+    };
+}
+
+Frustum extractFrustum(const glm::mat4& viewProjection)
+{
+    //Gribb/Hartmann, glm is column major so row i is m[0][i], m[1][i], ...
+    auto row = [&](int i){
+        return glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+    };
+    Frustum frustum{
+        .planes = {
+            row(3) + row(0), //left
+            row(3) - row(0), //right
+            row(3) + row(1), //bottom
+            row(3) - row(1), //top
+            row(3) + row(2), //near
+            row(3) - row(2), //far
+        },
+    };
+    for(auto& plane : frustum.planes)
+        plane /= glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+void SphereList::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+}
+
+void SphereList::push(glm::vec3 center, float sphereRadius)
+{
+    x.push_back(center.x);
+    y.push_back(center.y);
+    z.push_back(center.z);
+    radius.push_back(sphereRadius);
+}
+
+size_t SphereList::size() const
+{
+    return x.size();
+}
+
+static size_t cullSpheresScalar(const Frustum& frustum, const SphereList& spheres, size_t begin, size_t end, uint8_t* visible)
+{
+    for(size_t i = begin; i < end; i++){
+        bool inside = true;
+        for(auto& plane : frustum.planes)
+            inside = inside && plane.x * spheres.x[i] + plane.y * spheres.y[i] + plane.z * spheres.z[i] + plane.w > -spheres.radius[i];
+        visible[i] = inside;
+    }
+    return end;
+}
+
+#ifdef CULLING_X86
+//Returns where it stopped, the tail that doesn't fill a register is left to the scalar loop
+static size_t cullSpheresSSE(const Frustum& frustum, const SphereList& spheres, size_t begin, size_t end, uint8_t* visible)
+{
+    size_t i = begin;
+    for(; i + 4 <= end; i += 4){
+        __m128 x = _mm_loadu_ps(&spheres.x[i]);
+        __m128 y = _mm_loadu_ps(&spheres.y[i]);
+        __m128 z = _mm_loadu_ps(&spheres.z[i]);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for(auto& plane : frustum.planes){
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), x),
+                                                    _mm_mul_ps(_mm_set1_ps(plane.y), y)),
+                                         _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), z),
+                                                    _mm_set1_ps(plane.w)));
+            inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, negativeRadius));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for(int lane = 0; lane < 4; lane++)
+            visible[i + lane] = (mask >> lane) & 1;
+    }
+    return i;
+}
+
+//Built for AVX even when the rest of the program isn't, only called when the cpu has it
+__attribute__((target("avx")))
+static size_t cullSpheresAVX(const Frustum& frustum, const SphereList& spheres, size_t begin, size_t end, uint8_t* visible)
+{
+    size_t i = begin;
+    for(; i + 8 <= end; i += 8){
+        __m256 x = _mm256_loadu_ps(&spheres.x[i]);
+        __m256 y = _mm256_loadu_ps(&spheres.y[i]);
+        __m256 z = _mm256_loadu_ps(&spheres.z[i]);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for(auto& plane : frustum.planes){
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), x),
+                                                          _mm256_mul_ps(_mm256_set1_ps(plane.y), y)),
+                                            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), z),
+                                                          _mm256_set1_ps(plane.w)));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GT_OQ));
+        }
+        int mask = _mm256_movemask_ps(inside);
+        for(int lane = 0; lane < 8; lane++)
+            visible[i + lane] = (mask >> lane) & 1;
+    }
+    return i;
+}
+#endif
+
+void cullSpheres(const Frustum& frustum, const SphereList& spheres, size_t begin, size_t end, uint8_t* visible)
+{
+#ifdef CULLING_X86
+    static const bool hasAVX = __builtin_cpu_supports("avx");
+    if(hasAVX)
+        begin = cullSpheresAVX(frustum, spheres, begin, end, visible);
+    begin = cullSpheresSSE(frustum, spheres, begin, end, visible);
+#endif
+    cullSpheresScalar(frustum, spheres, begin, end, visible);
+}
+
+}
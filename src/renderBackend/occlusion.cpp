@@ -0,0 +1,227 @@
+/*************************************************************************************
+ * @file occlusion.cpp
+ * @brief Implementation of the software occlusion buffer.
+ ************************************************************************************/
+
+#include "renderBackend/occlusion.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OCCLUSION_X86
+#endif
+
+namespace RenderBackend {
+
+OccluderMesh makeOccluderMesh(const common::Mesh& mesh)
+{
+    //Only the full level, a simplified one can stick out of the real surface
+    size_t indexCount = mesh.lods.empty() ? mesh.indices.size() : mesh.lods[0].indexCount;
+    OccluderMesh occluder{
+        .indices = std::vector<uint32_t>(mesh.indices.begin(), mesh.indices.begin() + indexCount),
+    };
+    occluder.positions.reserve(mesh.vertices.size());
+    for(auto& vertex : mesh.vertices)
+        occluder.positions.push_back(vertex.pos);
+    return occluder;
+}
+
+OcclusionBuffer::OcclusionBuffer(uint32_t width, uint32_t height) :
+    width(width), height(height), stride((width + 3) & ~3u)
+{
+    depth.resize(stride * height, 1.0f);
+}
+
+void OcclusionBuffer::begin(const glm::mat4& viewProjection)
+{
+    this->viewProjection = viewProjection;
+    std::fill(depth.begin(), depth.end(), 1.0f);
+    triangles.clear();
+}
+
+void OcclusionBuffer::addOccluder(const OccluderMesh& mesh, const glm::mat4& model)
+{
+    auto transform = viewProjection * model;
+    for(size_t i = 0; i + 2 < mesh.indices.size(); i += 3){
+        glm::vec3 screen[3];
+        bool clipped = false;
+        for(int corner = 0; corner < 3; corner++){
+            auto clip = transform * glm::vec4(mesh.positions[mesh.indices[i + corner]], 1.0f);
+            if(clip.w <= 0.0f || clip.z < -clip.w){
+                clipped = true;
+                break;
+            }
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            screen[corner] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z);
+        }
+        if(clipped)
+            continue;
+
+        //Both windings are drawn, swapping makes the inside positive for all edges
+        float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y) -
+                     (screen[1].y - screen[0].y) * (screen[2].x - screen[0].x);
+        if(std::abs(area) < 1e-6f)
+            continue;
+        if(area < 0.0f){
+            std::swap(screen[1], screen[2]);
+            area = -area;
+        }
+
+        glm::vec3 minCorner = glm::min(glm::min(screen[0], screen[1]), screen[2]);
+        glm::vec3 maxCorner = glm::max(glm::max(screen[0], screen[1]), screen[2]);
+        Triangle triangle{
+            .minX = std::max(static_cast<int32_t>(std::floor(minCorner.x)), 0),
+            .maxX = std::min(static_cast<int32_t>(std::floor(maxCorner.x)), static_cast<int32_t>(width) - 1),
+            .minY = std::max(static_cast<int32_t>(std::floor(minCorner.y)), 0),
+            .maxY = std::min(static_cast<int32_t>(std::floor(maxCorner.y)), static_cast<int32_t>(height) - 1),
+        };
+        if(triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            continue;
+
+        //Edge i is the one facing vertex i, it is worth area on that vertex
+        for(int edge = 0; edge < 3; edge++){
+            auto& a = screen[(edge + 1) % 3];
+            auto& b = screen[(edge + 2) % 3];
+            triangle.edgeX[edge] = a.y - b.y;
+            triangle.edgeY[edge] = b.x - a.x;
+            triangle.edgeOffset[edge] = a.x * b.y - b.x * a.y;
+        }
+        //Barycentrics are the edges over the area, so is the interpolated depth
+        glm::vec3 z(screen[0].z, screen[1].z, screen[2].z);
+        triangle.depthX = glm::dot(triangle.edgeX, z) / area;
+        triangle.depthY = glm::dot(triangle.edgeY, z) / area;
+        triangle.depthOffset = glm::dot(triangle.edgeOffset, z) / area;
+        triangles.push_back(triangle);
+    }
+}
+
+#ifdef OCCLUSION_X86
+void OcclusionBuffer::rasterizeRow(const Triangle& triangle, int32_t y, int32_t minX, int32_t maxX)
+{
+    float centerY = y + 0.5f;
+    __m128 edgeX[3];
+    __m128 edgeRow[3];
+    for(int edge = 0; edge < 3; edge++){
+        edgeX[edge] = _mm_set1_ps(triangle.edgeX[edge]);
+        edgeRow[edge] = _mm_set1_ps(triangle.edgeY[edge] * centerY + triangle.edgeOffset[edge]);
+    }
+    __m128 depthX = _mm_set1_ps(triangle.depthX);
+    __m128 depthRow = _mm_set1_ps(triangle.depthY * centerY + triangle.depthOffset);
+    __m128 laneCenters = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 zero = _mm_setzero_ps();
+
+    //Starts on a register boundary, the rows are padded so the last store stays inside
+    float* row = &depth[y * stride];
+    for(int32_t x = minX & ~3; x <= maxX; x += 4){
+        __m128 centerX = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneCenters);
+        __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[0], centerX), edgeRow[0]), zero);
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[1], centerX), edgeRow[1]), zero));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[2], centerX), edgeRow[2]), zero));
+        if(_mm_movemask_ps(inside) == 0)
+            continue;
+        __m128 z = _mm_add_ps(_mm_mul_ps(depthX, centerX), depthRow);
+        __m128 previous = _mm_loadu_ps(row + x);
+        __m128 nearest = _mm_min_ps(previous, z);
+        _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, previous)));
+    }
+}
+#else
+void OcclusionBuffer::rasterizeRow(const Triangle& triangle, int32_t y, int32_t minX, int32_t maxX)
+{
+    float centerY = y + 0.5f;
+    float* row = &depth[y * stride];
+    for(int32_t x = minX; x <= maxX; x++){
+        glm::vec3 center(x + 0.5f, centerY, 1.0f);
+        bool inside = true;
+        for(int edge = 0; edge < 3; edge++)
+            inside = inside && triangle.edgeX[edge] * center.x + triangle.edgeY[edge] * center.y + triangle.edgeOffset[edge] >= 0.0f;
+        if(inside)
+            row[x] = std::min(row[x], triangle.depthX * center.x + triangle.depthY * center.y + triangle.depthOffset);
+    }
+}
+#endif
+
+void OcclusionBuffer::rasterize(uint32_t firstRow, uint32_t lastRow)
+{
+    int32_t bandMin = static_cast<int32_t>(firstRow);
+    int32_t bandMax = static_cast<int32_t>(std::min(lastRow, height)) - 1;
+    for(auto& triangle : triangles){
+        int32_t minY = std::max(triangle.minY, bandMin);
+        int32_t maxY = std::min(triangle.maxY, bandMax);
+        for(int32_t y = minY; y <= maxY; y++)
+            rasterizeRow(triangle, y, triangle.minX, triangle.maxX);
+    }
+}
+
+bool OcclusionBuffer::isOccluded(glm::vec3 min, glm::vec3 max) const
+{
+    glm::vec2 minScreen(static_cast<float>(width), static_cast<float>(height));
+    glm::vec2 maxScreen(0.0f);
+    float nearest = 1.0f;
+    for(int corner = 0; corner < 8; corner++){
+        glm::vec3 position((corner & 1) ? max.x : min.x,
+                           (corner & 2) ? max.y : min.y,
+                           (corner & 4) ? max.z : min.z);
+        auto clip = viewProjection * glm::vec4(position, 1.0f);
+        //Reaches the camera, there is nothing in front of it to hide it
+        if(clip.w <= 0.0f || clip.z < -clip.w)
+            return false;
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        glm::vec2 screen((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height);
+        minScreen = glm::min(minScreen, screen);
+        maxScreen = glm::max(maxScreen, screen);
+        nearest = std::min(nearest, ndc.z);
+    }
+    int32_t minX = std::max(static_cast<int32_t>(std::floor(minScreen.x)), 0);
+    int32_t maxX = std::min(static_cast<int32_t>(std::floor(maxScreen.x)), static_cast<int32_t>(width) - 1);
+    int32_t minY = std::max(static_cast<int32_t>(std::floor(minScreen.y)), 0);
+    int32_t maxY = std::min(static_cast<int32_t>(std::floor(maxScreen.y)), static_cast<int32_t>(height) - 1);
+    //Off screen, left to the frustum test
+    if(minX > maxX || minY > maxY)
+        return false;
+
+#ifdef OCCLUSION_X86
+    __m128 nearestDepth = _mm_set1_ps(nearest);
+    __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    __m128 first = _mm_set1_ps(static_cast<float>(minX));
+    __m128 last = _mm_set1_ps(static_cast<float>(maxX));
+    for(int32_t y = minY; y <= maxY; y++){
+        const float* row = &depth[y * stride];
+        for(int32_t x = minX & ~3; x <= maxX; x += 4){
+            __m128 lane = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lanes);
+            __m128 covered = _mm_and_ps(_mm_cmpge_ps(lane, first), _mm_cmple_ps(lane, last));
+            __m128 behind = _mm_cmpge_ps(_mm_loadu_ps(row + x), nearestDepth);
+            if(_mm_movemask_ps(_mm_and_ps(covered, behind)) != 0)
+                return false;
+        }
+    }
+#else
+    for(int32_t y = minY; y <= maxY; y++){
+        const float* row = &depth[y * stride];
+        for(int32_t x = minX; x <= maxX; x++){
+            if(row[x] >= nearest)
+                return false;
+        }
+    }
+#endif
+    return true;
+}
+
+uint32_t OcclusionBuffer::getWidth() const
+{
+    return width;
+}
+
+uint32_t OcclusionBuffer::getHeight() const
+{
+    return height;
+}
+
+size_t OcclusionBuffer::getTriangleCount() const
+{
+    return triangles.size();
+}
+
+}
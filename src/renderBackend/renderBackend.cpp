@@ -12,10 +12,16 @@
 #include <cstdint>
 #include <cstdio>
 #include <fstream>
+#include <chrono>
 #include <glm/fwd.hpp>
 #include <ostream>
 #include <string>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 #include <set>
@@ -102,6 +108,8 @@ vk::PhysicalDevice selectPhysicalDevice(vk::Instance instance, std::vector<const
 	requiredExtensions.erase(a.substr(0, a.find((char)0)));
     }
 
+    //Discrete first, anything else (integrated, lavapipe...) only when there is no discrete gpu
+    std::optional<vk::PhysicalDevice> fallback;
     for (auto& device : instance.enumeratePhysicalDevices())
     {
         if(device.getProperties().deviceType == vk::PhysicalDeviceType::eDiscreteGpu)
@@ -113,11 +121,28 @@ vk::PhysicalDevice selectPhysicalDevice(vk::Instance instance, std::vector<const
             checkPhysicalDeviceExtensionSupport(device, requiredExtensions);
             return device;
         }
+        if(!fallback.has_value() || device.getProperties().deviceType == vk::PhysicalDeviceType::eIntegratedGpu)
+            fallback = device;
     } 
+    if(fallback.has_value()){
+        std::cout << "[📃] RenderBackend: no discrete gpu, using " << fallback.value().getProperties().deviceName << std::endl;
+        checkPhysicalDeviceExtensionSupport(fallback.value(), requiredExtensions);
+        return fallback.value();
+    }
     std::cout << "No device found... killing myself rn";
     exit(0);
 }
 
+bool hasDeviceExtension(vk::PhysicalDevice physicalDevice, const std::string& name)
+{
+    for(auto& extension : physicalDevice.enumerateDeviceExtensionProperties()){
+        std::string extensionName(extension.extensionName);
+        if(extensionName.substr(0, extensionName.find((char)0)) == name)
+            return true;
+    }
+    return false;
+}
+
 void selectQueueFamilies(vk::PhysicalDevice physicalDevice,
              vk::SurfaceKHR surface,
              std::optional<uint32_t> &graphical,
@@ -144,6 +169,24 @@ void selectQueueFamilies(vk::PhysicalDevice physicalDevice,
     }
 }
 
+//FNV-1a
+const uint64_t hashSeed = 14695981039346656037ull;
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = hashSeed)
+{
+    auto bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hashCombine(uint64_t hash, uint64_t value)
+{
+    return hashBytes(&value, sizeof(value), hash);
+}
+
 uint32_t findMemoryType(vk::PhysicalDevice device, uint32_t type, vk::MemoryPropertyFlags properties){
     vk::PhysicalDeviceMemoryProperties devProperties = device.getMemoryProperties();
 
@@ -157,16 +200,411 @@ uint32_t findMemoryType(vk::PhysicalDevice device, uint32_t type, vk::MemoryProp
     throw std::runtime_error("Couldn't find the right type of memory to allocate");
 }
 
+vk::DescriptorType toDescriptorType(ReflectedDescriptorType type)
+{
+    switch(type){
+    case ReflectedDescriptorType::eUniformBuffer: return vk::DescriptorType::eUniformBuffer;
+    case ReflectedDescriptorType::eStorageBuffer: return vk::DescriptorType::eStorageBuffer;
+    case ReflectedDescriptorType::eCombinedImageSampler: return vk::DescriptorType::eCombinedImageSampler;
+    case ReflectedDescriptorType::eSampledImage: return vk::DescriptorType::eSampledImage;
+    case ReflectedDescriptorType::eStorageImage: return vk::DescriptorType::eStorageImage;
+    case ReflectedDescriptorType::eSampler: return vk::DescriptorType::eSampler;
+    }
+    return vk::DescriptorType::eUniformBuffer;
+}
+
+//Full chain down to 1x1
+uint32_t mipLevelCount(vk::Extent2D size)
+{
+    uint32_t levels = 1;
+    while((size.width >> levels) > 0 || (size.height >> levels) > 0)
+        levels++;
+    return levels;
+}
+
+
+/*###################### MemoryAllocator methods ######################################*/
+const vk::DeviceSize defaultBlockSize = 64 * 1024 * 1024;
+const uint32_t minAllocationOrder = 8; //256 bytes
+
+uint32_t ceilLog2(vk::DeviceSize value)
+{
+    uint32_t order = 0;
+    while((vk::DeviceSize(1) << order) < value)
+        order++;
+    return order;
+}
+
+MemoryAllocator::MemoryAllocator(vk::Device device, vk::PhysicalDevice physicalDevice) :
+    device(device), physicalDevice(physicalDevice)
+{
+    memoryProperties = physicalDevice.getMemoryProperties();
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+    for(auto& [poolId, pool] : pools){
+        for(auto& block : pool.blocks){
+            if(block.memory)
+                device.freeMemory(block.memory);
+        }
+    }
+}
+
+uint32_t MemoryAllocator::createBlock(Pool& pool, vk::DeviceSize size, bool dedicated)
+{
+    vk::MemoryAllocateInfo memAllocInfo{
+        .allocationSize = size,
+        .memoryTypeIndex = pool.memoryTypeIndex,
+    };
+
+    Block block{
+        .memory = device.allocateMemory(memAllocInfo),
+        .size = size,
+        .dedicated = dedicated,
+        .mapped = nullptr,
+        .maxOrder = ceilLog2(size),
+    };
+    auto propertyFlags = memoryProperties.memoryTypes[pool.memoryTypeIndex].propertyFlags;
+    if(propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible){
+        block.mapped = static_cast<char*>(device.mapMemory(block.memory, 0, VK_WHOLE_SIZE));
+    }
+    if(!dedicated){
+        block.freeLists.resize(block.maxOrder + 1);
+        block.freeLists[block.maxOrder].insert(0);
+    }
+    stats.deviceAllocations++;
+    stats.reservedBytes += size;
+
+    //Reuse the slot of a block that was already given back to the driver
+    for(uint32_t i = 0; i < pool.blocks.size(); i++){
+        if(!pool.blocks[i].memory){
+            pool.blocks[i] = std::move(block);
+            return i;
+        }
+    }
+    pool.blocks.push_back(std::move(block));
+    return pool.blocks.size() - 1;
+}
+
+std::optional<vk::DeviceSize> MemoryAllocator::allocateFromBlock(Block& block, uint32_t order)
+{
+    uint32_t freeOrder = order;
+    while(freeOrder <= block.maxOrder && block.freeLists[freeOrder].empty())
+        freeOrder++;
+    if(freeOrder > block.maxOrder)
+        return std::nullopt;
+
+    vk::DeviceSize offset = *block.freeLists[freeOrder].begin();
+    block.freeLists[freeOrder].erase(block.freeLists[freeOrder].begin());
+    //Split until we get to the size we want, the upper halves go to the free lists
+    while(freeOrder > order){
+        freeOrder--;
+        block.freeLists[freeOrder].insert(offset + (vk::DeviceSize(1) << freeOrder));
+    }
+    block.usedOrders[offset] = order;
+    return offset;
+}
+
+void MemoryAllocator::freeFromBlock(Block& block, vk::DeviceSize offset)
+{
+    uint32_t order = block.usedOrders[offset];
+    block.usedOrders.erase(offset);
+    //Merge with the buddy while it is free
+    while(order < block.maxOrder){
+        vk::DeviceSize buddy = offset ^ (vk::DeviceSize(1) << order);
+        auto it = block.freeLists[order].find(buddy);
+        if(it == block.freeLists[order].end())
+            break;
+        block.freeLists[order].erase(it);
+        offset = std::min(offset, buddy);
+        order++;
+    }
+    block.freeLists[order].insert(offset);
+}
+
+Allocation MemoryAllocator::allocate(vk::MemoryRequirements requirements, vk::MemoryPropertyFlags properties, bool linear)
+{
+    uint32_t memoryTypeIndex = findMemoryType(physicalDevice, requirements.memoryTypeBits, properties);
+    uint32_t poolId = memoryTypeIndex * 2 + (linear ? 1 : 0);
+    if(pools.find(poolId) == pools.end()){
+        //Small heaps (eg. the 256MB BAR heap) get smaller blocks so we don't eat all of it
+        auto heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+        vk::DeviceSize blockSize = defaultBlockSize;
+        while(blockSize > (vk::DeviceSize(1) << minAllocationOrder) && blockSize * 8 > heapSize)
+            blockSize >>= 1;
+        pools[poolId] = Pool{
+            .memoryTypeIndex = memoryTypeIndex,
+            .blockSize = blockSize,
+        };
+    }
+    Pool& pool = pools[poolId];
+
+    vk::DeviceSize size = std::max(requirements.size, requirements.alignment);
+    stats.requestedBytes += requirements.size;
+    stats.subAllocations++;
+
+    if(size > pool.blockSize){
+        auto blockIndex = createBlock(pool, requirements.size, true);
+        stats.usedBytes += requirements.size;
+        return Allocation{
+            .poolId = poolId,
+            .blockIndex = blockIndex,
+            .memory = pool.blocks[blockIndex].memory,
+            .offset = 0,
+            .size = requirements.size,
+            .mapped = pool.blocks[blockIndex].mapped,
+        };
+    }
+
+    //Buddy offsets are always multiples of the allocation size so rounding the size
+    //to the alignment is enough to respect it.
+    uint32_t order = std::max(minAllocationOrder, ceilLog2(size));
+    stats.usedBytes += vk::DeviceSize(1) << order;
+    for(uint32_t i = 0; i < pool.blocks.size(); i++){
+        auto& block = pool.blocks[i];
+        if(!block.memory || block.dedicated)
+            continue;
+        auto offset = allocateFromBlock(block, order);
+        if(offset.has_value()){
+            return Allocation{
+                .poolId = poolId,
+                .blockIndex = i,
+                .memory = block.memory,
+                .offset = offset.value(),
+                .size = requirements.size,
+                .mapped = block.mapped ? block.mapped + offset.value() : nullptr,
+            };
+        }
+    }
+
+    auto blockIndex = createBlock(pool, pool.blockSize, false);
+    auto& block = pool.blocks[blockIndex];
+    auto offset = allocateFromBlock(block, order);
+    return Allocation{
+        .poolId = poolId,
+        .blockIndex = blockIndex,
+        .memory = block.memory,
+        .offset = offset.value(),
+        .size = requirements.size,
+        .mapped = block.mapped ? block.mapped + offset.value() : nullptr,
+    };
+}
+
+void MemoryAllocator::free(Allocation allocation)
+{
+    auto& block = pools[allocation.poolId].blocks[allocation.blockIndex];
+    stats.requestedBytes -= allocation.size;
+    stats.subAllocations--;
+
+    if(block.dedicated){
+        stats.usedBytes -= allocation.size;
+        stats.reservedBytes -= block.size;
+        stats.deviceAllocations--;
+        if(block.mapped)
+            device.unmapMemory(block.memory);
+        device.freeMemory(block.memory);
+        block.memory = nullptr;
+        return;
+    }
+
+    stats.usedBytes -= vk::DeviceSize(1) << block.usedOrders[allocation.offset];
+    freeFromBlock(block, allocation.offset);
+    //XXX: empty blocks are kept alive, next allocation will probably need them anyway
+}
+
+AllocatorStats MemoryAllocator::getStats()
+{
+    return stats;
+}
+
+
+/*###################### StagingRing methods ######################################*/
+const vk::DeviceSize stagingRingSize = 32 * 1024 * 1024;
+
+vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+StagingRing::StagingRing(vk::DeviceSize capacity) : capacity(capacity)
+{}
+
+std::optional<vk::DeviceSize> StagingRing::allocate(vk::DeviceSize size, vk::DeviceSize alignment)
+{
+    if(used == 0){
+        head = 0;
+        tail = 0;
+    }
+    vk::DeviceSize offset = alignUp(head, alignment);
+    bool full = used > 0 && head == tail;
+    if(full)
+        return std::nullopt;
+
+    if(head >= tail){
+        //Free space is [head, capacity) and [0, tail)
+        if(offset + size <= capacity){
+            used += offset - head + size;
+            pending += offset - head + size;
+            head = offset + size;
+            return offset;
+        }
+        if(size <= tail){
+            //Wrap around, the end of the ring is wasted until this is released
+            used += capacity - head + size;
+            pending += capacity - head + size;
+            head = size;
+            return 0;
+        }
+    }
+    else if(offset + size <= tail){
+        used += offset - head + size;
+        pending += offset - head + size;
+        head = offset + size;
+        return offset;
+    }
+    return std::nullopt;
+}
+
+void StagingRing::submitted(UploadTicket ticket)
+{
+    if(pending == 0)
+        return;
+    submissions.push_back(Submission{
+        .ticket = ticket,
+        .end = head,
+        .bytes = pending,
+    });
+    pending = 0;
+}
+
+void StagingRing::release(UploadTicket completedTicket)
+{
+    while(!submissions.empty() && submissions.front().ticket <= completedTicket){
+        used -= submissions.front().bytes;
+        tail = submissions.front().end;
+        submissions.pop_front();
+    }
+}
+
+vk::DeviceSize StagingRing::getCapacity()
+{
+    return capacity;
+}
+
+
+/*###################### UploadBatcher methods ######################################*/
+UploadBatcher::UploadBatcher(vk::Device device, Commands* commands) :
+    device(device), commands(commands)
+{}
+
+UploadBatcher::~UploadBatcher()
+{
+    while(waitOldest());
+    for(auto& fence : freeFences)
+        device.destroyFence(fence);
+}
+
+vk::CommandBuffer UploadBatcher::record()
+{
+    if(!recording.has_value())
+        recording = commands->BeginSingleTimeCommand();
+    return recording.value();
+}
+
+UploadTicket UploadBatcher::getRecordingTicket()
+{
+    return nextTicket;
+}
+
+UploadTicket UploadBatcher::getCompletedTicket()
+{
+    return completedTicket;
+}
+
+bool UploadBatcher::hasRecordedWork()
+{
+    return recording.has_value();
+}
+
+UploadTicket UploadBatcher::flush()
+{
+    if(!recording.has_value())
+        return nextTicket - 1;
+
+    vk::Fence fence;
+    if(freeFences.empty()){
+        fence = device.createFence(vk::FenceCreateInfo{});
+    }
+    else{
+        fence = freeFences.back();
+        freeFences.pop_back();
+    }
+    commands->EndSingleTimeCommand(recording.value(), fence);
+    inFlight.push_back(Batch{
+        .ticket = nextTicket,
+        .commandBuffer = recording.value(),
+        .fence = fence,
+    });
+    recording.reset();
+    return nextTicket++;
+}
+
+void UploadBatcher::retire()
+{
+    auto& batch = inFlight.front();
+    commands->freeSingleTimeCommand(batch.commandBuffer);
+    device.resetFences(batch.fence);
+    freeFences.push_back(batch.fence);
+    completedTicket = batch.ticket;
+    inFlight.pop_front();
+}
+
+void UploadBatcher::poll()
+{
+    //Batches go to the same queue, so they are retired in order
+    while(!inFlight.empty() && device.getFenceStatus(inFlight.front().fence) == vk::Result::eSuccess)
+        retire();
+}
+
+bool UploadBatcher::waitOldest()
+{
+    if(inFlight.empty())
+        return false;
+    auto result = device.waitForFences(inFlight.front().fence, true, UINT64_MAX);
+    retire();
+    return true;
+}
+
 
 /*###################### ResourceManager methods ######################################*/
 ResourceManager::ResourceManager(vk::Device device,
                  vk::PhysicalDevice physicalDevice,
                  Commands* commands) :
     device(device), physicalDevice(physicalDevice), commands(commands)
-{}
+{
+    allocator = new MemoryAllocator(device, physicalDevice);
+    stagingBuffer = createBuffer(BufferType::eStageBuffer, stagingRingSize);
+    stagingRing = new StagingRing(stagingRingSize);
+    uploadBatcher = new UploadBatcher(device, commands);
+}
 
 ResourceManager::~ResourceManager()
-{}
+{
+    flushUploads();
+    delete uploadBatcher;
+    for(auto& [id, view] : imageViews)
+        device.destroyImageView(view);
+    for(auto& [id, views] : imageMipViews)
+        for(auto view : views)
+            device.destroyImageView(view);
+    for(auto& [id, image] : images)
+        device.destroyImage(image);
+    for(auto& [id, buffer] : buffers)
+        device.destroyBuffer(buffer);
+    delete stagingRing;
+    delete allocator;
+}
 
 BufferId ResourceManager::createBuffer(BufferType type, vk::DeviceSize size)
 {
@@ -176,10 +614,11 @@ BufferId ResourceManager::createBuffer(BufferType type, vk::DeviceSize size)
     vk::BufferUsageFlags usageFlags;
     switch (type) {
         case BufferType::eVertexBuffer:
-            usageFlags = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+            //TransferSrc so the GeometryPool can compact them
+            usageFlags = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc;
             break;
         case BufferType::eIndexBuffer:
-            usageFlags = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+            usageFlags = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc;
             break;
         case BufferType::eStageBuffer:
             usageFlags = vk::BufferUsageFlagBits::eTransferSrc;
@@ -187,6 +626,12 @@ BufferId ResourceManager::createBuffer(BufferType type, vk::DeviceSize size)
         case BufferType::eUniformBuffer:
             usageFlags = vk::BufferUsageFlagBits::eUniformBuffer;
             break;
+        case BufferType::eStorageBuffer:
+            usageFlags = vk::BufferUsageFlagBits::eStorageBuffer;
+            break;
+        case BufferType::eIndirectBuffer:
+            usageFlags = vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer;
+            break;
     }
 
     vk::BufferCreateInfo bufferInfo{
@@ -200,54 +645,124 @@ BufferId ResourceManager::createBuffer(BufferType type, vk::DeviceSize size)
     vk::MemoryPropertyFlags memFlags;
     switch (type) {
         case BufferType::eVertexBuffer:
-            //TODO: I think this can be deviceCoherent? Since I just populate it once with a stage buffer and that's it.
-            memFlags = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
+            //Only written by copies from the staging ring
+            memFlags = vk::MemoryPropertyFlagBits::eDeviceLocal;
             break;
         case BufferType::eIndexBuffer:
-            memFlags = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
+            memFlags = vk::MemoryPropertyFlagBits::eDeviceLocal;
             break;
         case BufferType::eStageBuffer:
             memFlags = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
             break;
         case BufferType::eUniformBuffer:
+        case BufferType::eStorageBuffer:
+        case BufferType::eIndirectBuffer:
             memFlags = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
             break;
     }
 
     auto memRequirements = device.getBufferMemoryRequirements(buffer);
-    vk::MemoryAllocateInfo memAllocInfo{
-        // I do this because in the vulkan spec it says that an allocation cannot be smaller
-        // than the requirements.size (although it works either way)
-        .allocationSize = bufferInfo.size >= memRequirements.size ?
-                            bufferInfo.size :
-                            memRequirements.size, 
-        .memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, memFlags),
-    };
-    auto memory = device.allocateMemory(memAllocInfo);
-    bufferMemories[bufferId] = memory;
-    device.bindBufferMemory(buffer, memory, 0);
+    auto allocation = allocator->allocate(memRequirements, memFlags, true);
+    bufferAllocations[bufferId] = allocation;
+    device.bindBufferMemory(buffer, allocation.memory, allocation.offset);
     bufferSizes[bufferId] = size;
     
     return bufferId;
 }
 
-void ResourceManager::insertDataBuffer(BufferId id, vk::DeviceSize size, void* data)
+void ResourceManager::destroyBuffer(BufferId id)
+{
+    device.destroyBuffer(buffers[id]);
+    allocator->free(bufferAllocations[id]);
+    buffers.erase(id);
+    bufferAllocations.erase(id);
+    bufferSizes.erase(id);
+}
+
+void ResourceManager::insertDataBuffer(BufferId id, vk::DeviceSize size, void* data, vk::DeviceSize offset)
 {
-    void* bufferStart = device.mapMemory(bufferMemories[id], 0, size);
-    std::memcpy(bufferStart, data, (size_t) size);
-    device.unmapMemory(bufferMemories[id]);
+    auto& allocation = bufferAllocations[id];
+    if(!allocation.mapped){
+        throw std::runtime_error("insertDataBuffer on a buffer that isn't host visible");
+    }
+    std::memcpy(static_cast<char*>(allocation.mapped) + offset, data, (size_t) size);
 }
 
-void ResourceManager::copyBuffers(BufferId source, BufferId destination, vk::DeviceSize size)
+UploadTicket ResourceManager::copyBuffers(BufferId source, BufferId destination, vk::DeviceSize size)
 {
-    auto commmandBuffer = commands->BeginSingleTimeCommand();
     vk::BufferCopy copyCommand{
         .size = size,
     };
     std::vector<vk::BufferCopy> copyCommands{copyCommand};
     
-    commmandBuffer.copyBuffer(buffers[source], buffers[destination], copyCommands);
-    commands->EndSingleTimeCommand(commmandBuffer, true);
+    uploadBatcher->record().copyBuffer(buffers[source], buffers[destination], copyCommands);
+    return uploadBatcher->getRecordingTicket();
+}
+
+UploadTicket ResourceManager::copyBufferRegions(BufferId source, BufferId destination, const std::vector<vk::BufferCopy>& regions)
+{
+    auto commandBuffer = uploadBatcher->record();
+    //The source may still be written by uploads recorded before this one
+    vk::MemoryBarrier barrier{
+        .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+        .dstAccessMask = vk::AccessFlagBits::eTransferRead,
+    };
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer,
+                                  vk::DependencyFlags{}, barrier, nullptr, nullptr);
+    if(!regions.empty())
+        commandBuffer.copyBuffer(buffers[source], buffers[destination], regions);
+    return uploadBatcher->getRecordingTicket();
+}
+
+vk::DeviceSize ResourceManager::stage(vk::DeviceSize size, void* data)
+{
+    if(size > stagingRing->getCapacity()){
+        throw std::runtime_error("Upload doesn't fit in the staging ring");
+    }
+
+    auto offset = stagingRing->allocate(size, 16);
+    while(!offset.has_value()){
+        //Ring is full, submit what is recorded and wait for the oldest batch to free some space
+        flushUploads();
+        uploadBatcher->waitOldest();
+        stagingRing->release(uploadBatcher->getCompletedTicket());
+        offset = stagingRing->allocate(size, 16);
+    }
+    insertDataBuffer(stagingBuffer, size, data, offset.value());
+    return offset.value();
+}
+
+UploadTicket ResourceManager::uploadBuffer(BufferId destination, vk::DeviceSize size, void* data, vk::DeviceSize destinationOffset)
+{
+    auto offset = stage(size, data);
+
+    vk::BufferCopy copyCommand{
+        .srcOffset = offset,
+        .dstOffset = destinationOffset,
+        .size = size,
+    };
+    uploadBatcher->record().copyBuffer(buffers[stagingBuffer], buffers[destination], copyCommand);
+    return uploadBatcher->getRecordingTicket();
+}
+
+void ResourceManager::flushUploads()
+{
+    uploadBatcher->poll();
+    stagingRing->release(uploadBatcher->getCompletedTicket());
+    stagingRing->submitted(uploadBatcher->flush());
+}
+
+bool ResourceManager::isUploaded(UploadTicket ticket)
+{
+    return ticket <= uploadBatcher->getCompletedTicket();
+}
+
+void ResourceManager::waitUpload(UploadTicket ticket)
+{
+    if(ticket >= uploadBatcher->getRecordingTicket())
+        flushUploads();
+    while(!isUploaded(ticket) && uploadBatcher->waitOldest());
+    stagingRing->release(uploadBatcher->getCompletedTicket());
 }
 
 vk::Buffer ResourceManager::getBuffer(BufferId id)
@@ -255,6 +770,11 @@ vk::Buffer ResourceManager::getBuffer(BufferId id)
     return buffers[id];
 }
 
+Allocation ResourceManager::getBufferAllocation(BufferId id)
+{
+    return bufferAllocations[id];
+}
+
 ImageId ResourceManager::createImage(vk::Extent2D size, ImageType type)
 {
     static ImageId imageId = 0;
@@ -264,28 +784,34 @@ ImageId ResourceManager::createImage(vk::Extent2D size, ImageType type)
     static std::unordered_map<ImageType, vk::Format> imageFormats = {
         {ImageType::eDepth, vk::Format::eD32Sfloat},
         {ImageType::eTexture, vk::Format::eR8G8B8A8Srgb},
+        {ImageType::eDepthPyramid, vk::Format::eR32Sfloat},
     };
     static std::unordered_map<ImageType, vk::ImageTiling> imageTilings = {
         {ImageType::eDepth, vk::ImageTiling::eOptimal},
         {ImageType::eTexture, vk::ImageTiling::eOptimal},
+        {ImageType::eDepthPyramid, vk::ImageTiling::eOptimal},
     };
     static std::unordered_map<ImageType, vk::ImageUsageFlags> imageUsages = {
-        {ImageType::eDepth, vk::ImageUsageFlagBits::eDepthStencilAttachment},
+        {ImageType::eDepth, vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled},
         {ImageType::eTexture, vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled},
+        {ImageType::eDepthPyramid, vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled},
     };
     static std::unordered_map<ImageType, vk::MemoryPropertyFlags> imageMemFlags = {
         {ImageType::eDepth, vk::MemoryPropertyFlagBits::eDeviceLocal},
         {ImageType::eTexture, vk::MemoryPropertyFlagBits::eDeviceLocal},
+        {ImageType::eDepthPyramid, vk::MemoryPropertyFlagBits::eDeviceLocal},
     };
     static std::unordered_map<ImageType, vk::ImageAspectFlags> imageAspectFlags = {
         {ImageType::eDepth, vk::ImageAspectFlagBits::eDepth},
         {ImageType::eTexture, vk::ImageAspectFlagBits::eColor},
+        {ImageType::eDepthPyramid, vk::ImageAspectFlagBits::eColor},
     };
 
     vk::Format format = imageFormats[type];
     vk::ImageTiling tiling = imageTilings[type];
     vk::ImageUsageFlags usage = imageUsages[type];
     vk::MemoryPropertyFlags memFlags = imageMemFlags[type];
+    uint32_t mipLevels = type == ImageType::eDepthPyramid ? mipLevelCount(size) : 1;
 
     vk::ImageCreateInfo imageCreateInfo{
         .imageType = vk::ImageType::e2D,
@@ -295,7 +821,7 @@ ImageId ResourceManager::createImage(vk::Extent2D size, ImageType type)
             .height = size.height,
             .depth = 1,
         },
-        .mipLevels = 1,
+        .mipLevels = mipLevels,
         .arrayLayers = 1,
         .samples = vk::SampleCountFlagBits::e1,
         .tiling = tiling,
@@ -307,13 +833,9 @@ ImageId ResourceManager::createImage(vk::Extent2D size, ImageType type)
     images[imageId] = image;
 
     auto memoryRequirements = device.getImageMemoryRequirements(image);
-    vk::MemoryAllocateInfo memoryAllocateInfo{
-        .allocationSize = memoryRequirements.size,
-        .memoryTypeIndex = findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, memFlags),
-    };
-    auto memory = device.allocateMemory(memoryAllocateInfo);
-    imageMemories[imageId] = memory;
-    device.bindImageMemory(image, memory, vk::DeviceSize{0});
+    auto allocation = allocator->allocate(memoryRequirements, memFlags, tiling == vk::ImageTiling::eLinear);
+    imageAllocations[imageId] = allocation;
+    device.bindImageMemory(image, allocation.memory, allocation.offset);
 
     vk::ImageViewCreateInfo imageViewCreateInfo{
         .image = image,
@@ -322,21 +844,31 @@ ImageId ResourceManager::createImage(vk::Extent2D size, ImageType type)
         .subresourceRange = {
             .aspectMask = imageAspectFlags[type],
             .baseMipLevel = 0,
-            .levelCount = 1,
+            .levelCount = mipLevels,
             .baseArrayLayer = 0,
             .layerCount = 1,
         }
     };
     imageViews[imageId] = device.createImageView(imageViewCreateInfo);
+    if(mipLevels > 1){
+        for(uint32_t level = 0; level < mipLevels; level++){
+            imageViewCreateInfo.subresourceRange.baseMipLevel = level;
+            imageViewCreateInfo.subresourceRange.levelCount = 1;
+            imageMipViews[imageId].push_back(device.createImageView(imageViewCreateInfo));
+        }
+    }
 
     return imageId;
 }
 
-void ResourceManager::transitionImage(ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout)
+UploadTicket ResourceManager::transitionImage(ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout)
 {
-    auto commandBuffer = commands->BeginSingleTimeCommand();
-
+    recordImageTransition(uploadBatcher->record(), imageId, oldLayout, newLayout);
+    return uploadBatcher->getRecordingTicket();
+}
 
+void ResourceManager::recordImageTransition(vk::CommandBuffer commandBuffer, ImageId imageId, vk::ImageLayout oldLayout, vk::ImageLayout newLayout)
+{
     vk::AccessFlags srcAccess;
     vk::AccessFlags dstAccess;
     vk::PipelineStageFlags srcStage;
@@ -355,6 +887,13 @@ void ResourceManager::transitionImage(ImageId imageId, vk::ImageLayout oldLayout
         srcStage = vk::PipelineStageFlagBits::eTransfer;
         dstStage = vk::PipelineStageFlagBits::eFragmentShader;
     }
+    else if(oldLayout == vk::ImageLayout::eUndefined && newLayout == vk::ImageLayout::eGeneral)
+    {
+        srcAccess = vk::AccessFlagBits::eNone;
+        dstAccess = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+        srcStage = vk::PipelineStageFlagBits::eTopOfPipe;
+        dstStage = vk::PipelineStageFlagBits::eComputeShader;
+    }
     else
     {
         std::cout << "Unsuported conversion between layouts." << std::endl;
@@ -362,6 +901,8 @@ void ResourceManager::transitionImage(ImageId imageId, vk::ImageLayout oldLayout
     }
 
     vk::ImageMemoryBarrier barrier{
+        .srcAccessMask = srcAccess,
+        .dstAccessMask = dstAccess,
         .oldLayout = oldLayout,
         .newLayout = newLayout,
         .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
@@ -370,24 +911,28 @@ void ResourceManager::transitionImage(ImageId imageId, vk::ImageLayout oldLayout
         .subresourceRange = {
             .aspectMask = vk::ImageAspectFlagBits::eColor,
             .baseMipLevel = 0,
-            .levelCount = 1,
+            .levelCount = VK_REMAINING_MIP_LEVELS,
             .baseArrayLayer = 0,
             .layerCount = 1,
         },
     };
-    std::vector<vk::ImageMemoryBarrier> barriers{barrier};
     commandBuffer.pipelineBarrier(srcStage, dstStage, vk::DependencyFlags{},
                                     0, nullptr,
                                     0, nullptr,
                                     1, &barrier);
-    commands->EndSingleTimeCommand(commandBuffer, true); //Should I wait tho?
 }
 
-void ResourceManager::copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size)
+UploadTicket ResourceManager::copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size)
 {
-    auto commandBuffer = commands->BeginSingleTimeCommand();
+    return copyBufferToImage(bufferId, imageId, size, 0);
+}
+
+UploadTicket ResourceManager::copyBufferToImage(BufferId bufferId, ImageId imageId, vk::Extent2D size, vk::DeviceSize bufferOffset)
+{
+    //Transitions and copy all go in the same command buffer
+    auto commandBuffer = uploadBatcher->record();
     vk::BufferImageCopy bufferImageCopyCommand{
-        .bufferOffset = 0,
+        .bufferOffset = bufferOffset,
         .bufferRowLength = 0, 
         .bufferImageHeight = 0,
         .imageSubresource = {
@@ -404,10 +949,16 @@ void ResourceManager::copyBufferToImage(BufferId bufferId, ImageId imageId, vk::
         },
     };
 
-    transitionImage(imageId, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal);
+    recordImageTransition(commandBuffer, imageId, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal);
     commandBuffer.copyBufferToImage(buffers[bufferId], images[imageId], vk::ImageLayout::eTransferDstOptimal, bufferImageCopyCommand);
-    commands->EndSingleTimeCommand(commandBuffer, true);
-    transitionImage(imageId, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
+    recordImageTransition(commandBuffer, imageId, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal);
+    return uploadBatcher->getRecordingTicket();
+}
+
+UploadTicket ResourceManager::uploadImage(ImageId imageId, vk::Extent2D size, vk::DeviceSize dataSize, void* data)
+{
+    auto offset = stage(dataSize, data);
+    return copyBufferToImage(stagingBuffer, imageId, size, offset);
 }
 
 vk::ImageView ResourceManager::getImageView(ImageId imageId)
@@ -415,6 +966,34 @@ vk::ImageView ResourceManager::getImageView(ImageId imageId)
     return imageViews[imageId];
 }
 
+vk::ImageView ResourceManager::getImageMipView(ImageId imageId, uint32_t level)
+{
+    return imageMipViews[imageId][level];
+}
+
+void ResourceManager::destroyImage(ImageId id)
+{
+    for(auto view : imageMipViews[id])
+        device.destroyImageView(view);
+    imageMipViews.erase(id);
+    device.destroyImageView(imageViews[id]);
+    device.destroyImage(images[id]);
+    allocator->free(imageAllocations[id]);
+    imageViews.erase(id);
+    images.erase(id);
+    imageAllocations.erase(id);
+}
+
+Allocation ResourceManager::getImageAllocation(ImageId id)
+{
+    return imageAllocations[id];
+}
+
+AllocatorStats ResourceManager::getAllocatorStats()
+{
+    return allocator->getStats();
+}
+
 
 /*####################### Command Methods ##################################*/
 Commands::Commands(vk::Device device, vk::Queue queue, int queueFamilyId, int nPools) : device(device), queue(queue), queueFamilyId(queueFamilyId)
@@ -462,6 +1041,21 @@ void Commands::EndSingleTimeCommand(vk::CommandBuffer commandBuffer, bool wait)
     }    
 }
 
+void Commands::EndSingleTimeCommand(vk::CommandBuffer commandBuffer, vk::Fence fence)
+{
+    commandBuffer.end();
+    vk::SubmitInfo submitInfo{
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
+    };
+    queue.submit(submitInfo, fence);
+}
+
+void Commands::freeSingleTimeCommand(vk::CommandBuffer commandBuffer)
+{
+    device.freeCommandBuffers(pool, commandBuffer);
+}
+
 void Commands::setPool(int poolNumber)
 {
     device.destroyCommandPool(pools[poolNumber]);
@@ -520,45 +1114,493 @@ void Commands::endCommand(vk::CommandBuffer buffer,
 }
 
 
-/*##################### DescriptorManager methods ####################################*/
-DescriptorManager::DescriptorManager(vk::Device device) : device(device)
-{
-    std::vector<vk::DescriptorPoolSize> poolSizes{
-        {vk::DescriptorType::eUniformBuffer, 1000},
-        {vk::DescriptorType::eCombinedImageSampler, 1000},
-    };
-
-    vk::DescriptorPoolCreateInfo createPoolInfo {
-        .maxSets = static_cast<uint32_t>(10000),
-        .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
-        .pPoolSizes = poolSizes.data(),
-    };
+/*##################### UniformRing methods ####################################*/
+const vk::DeviceSize uniformRingFrameSize = 4 * 1024 * 1024;
 
-    pool = device.createDescriptorPool(createPoolInfo);
+UniformRing::UniformRing(ResourceManager* resourceManager, vk::DeviceSize frameSize, vk::DeviceSize alignment, uint32_t frames) :
+    frameSize(frameSize), alignment(alignment)
+{
+    for(uint32_t i = 0; i < frames; i++)
+        buffers.push_back(resourceManager->createTypedBuffer<char>(BufferType::eUniformBuffer, frameSize));
 }
 
-DSLayoutId DescriptorManager::CreateLayout(std::vector<vk::DescriptorSetLayoutBinding> bindings)
+void UniformRing::beginFrame(uint32_t frame)
 {
-    vk::DescriptorSetLayoutCreateInfo layoutCreateInfo{
-        .bindingCount = static_cast<uint32_t>(bindings.size()),
-        .pBindings = bindings.data(),
-    };
-
-    static DSLayoutId id = 0;
-    auto _layout = device.createDescriptorSetLayout(layoutCreateInfo);
-    DescriptorSetLayout layout = {
-        .layoutId = id,
-        .DSLayout = _layout,
-        .bindings = bindings,
-    };
-    layouts[id] = layout;
-    freeDescriptorsByLayout[id] = std::stack<DescriptorSet>();
-    return id++;
+    this->frame = frame;
+    head = 0;
 }
 
-vk::DescriptorSetLayout DescriptorManager::getDSLayout(DSLayoutId id)
+std::optional<uint32_t> UniformRing::allocate(vk::DeviceSize size)
 {
-    return layouts[id].DSLayout;
+    vk::DeviceSize offset = alignUp(head, alignment);
+    if(offset + size > frameSize){
+        static bool warned = false;
+        if(!warned){
+            std::cout << "UniformRing: frame ran out of space, objects are being skipped." << std::endl;
+            warned = true;
+        }
+        return std::nullopt;
+    }
+    head = offset + size;
+    return static_cast<uint32_t>(offset);
+}
+
+vk::Buffer UniformRing::getBuffer(uint32_t frame)
+{
+    return buffers[frame].buffer;
+}
+
+vk::DeviceSize UniformRing::getUsedBytes()
+{
+    return head;
+}
+
+
+/*##################### RangeAllocator methods ####################################*/
+RangeAllocator::RangeAllocator(uint64_t capacity) : capacity(capacity)
+{
+    if(capacity > 0)
+        freeRanges[0] = capacity;
+}
+
+std::optional<uint64_t> RangeAllocator::allocate(uint64_t size)
+{
+    if(size == 0)
+        return 0;
+    for(auto it = freeRanges.begin(); it != freeRanges.end(); it++){
+        if(it->second < size)
+            continue;
+        auto offset = it->first;
+        auto remaining = it->second - size;
+        freeRanges.erase(it);
+        if(remaining > 0)
+            freeRanges[offset + size] = remaining;
+        used += size;
+        return offset;
+    }
+    return std::nullopt;
+}
+
+void RangeAllocator::free(uint64_t offset, uint64_t size)
+{
+    if(size == 0)
+        return;
+    used -= size;
+    auto next = freeRanges.lower_bound(offset);
+    if(next != freeRanges.end() && offset + size == next->first){
+        size += next->second;
+        next = freeRanges.erase(next);
+    }
+    if(next != freeRanges.begin()){
+        auto previous = std::prev(next);
+        if(previous->first + previous->second == offset){
+            previous->second += size;
+            return;
+        }
+    }
+    freeRanges[offset] = size;
+}
+
+uint64_t RangeAllocator::getCapacity()
+{
+    return capacity;
+}
+
+uint64_t RangeAllocator::getUsed()
+{
+    return used;
+}
+
+uint64_t RangeAllocator::getFragmented()
+{
+    auto freeSize = capacity - used;
+    if(!freeRanges.empty()){
+        auto last = std::prev(freeRanges.end());
+        if(last->first + last->second == capacity)
+            freeSize -= last->second;
+    }
+    return freeSize;
+}
+
+
+/*##################### GeometryPool methods ####################################*/
+//Holes are copied away once they are a quarter of the capacity
+const uint64_t geometryCompactionDivisor = 4;
+
+GeometryPool::GeometryPool(ResourceManager* resourceManager, uint64_t vertexCapacity, uint64_t indexCapacity, uint32_t framesInFlight) :
+    resourceManager(resourceManager), framesInFlight(framesInFlight)
+{
+    current = createBuffers(vertexCapacity, indexCapacity);
+}
+
+GeometryPool::~GeometryPool()
+{
+    finishCompaction(true);
+    for(auto& buffers : retired){
+        resourceManager->destroyBuffer(buffers.vertexBuffer);
+        resourceManager->destroyBuffer(buffers.indexBuffer);
+    }
+    resourceManager->destroyBuffer(current.vertexBuffer);
+    resourceManager->destroyBuffer(current.indexBuffer);
+}
+
+GeometryPool::Buffers GeometryPool::createBuffers(uint64_t vertexCapacity, uint64_t indexCapacity)
+{
+    return Buffers{
+        .vertexBuffer = resourceManager->createBuffer(BufferType::eVertexBuffer, vertexCapacity * sizeof(common::Vertex)),
+        .indexBuffer = resourceManager->createBuffer(BufferType::eIndexBuffer, indexCapacity * sizeof(uint32_t)),
+        .vertices = RangeAllocator(vertexCapacity),
+        .indices = RangeAllocator(indexCapacity),
+    };
+}
+
+std::optional<GeometryRange> GeometryPool::allocate(Buffers& buffers, uint64_t vertexCount, uint64_t indexCount)
+{
+    auto vertexOffset = buffers.vertices.allocate(vertexCount);
+    auto firstIndex = buffers.indices.allocate(indexCount);
+    if(!vertexOffset.has_value() || !firstIndex.has_value()){
+        if(vertexOffset.has_value())
+            buffers.vertices.free(vertexOffset.value(), vertexCount);
+        if(firstIndex.has_value())
+            buffers.indices.free(firstIndex.value(), indexCount);
+        return std::nullopt;
+    }
+    return GeometryRange{
+        .vertexOffset = static_cast<uint32_t>(vertexOffset.value()),
+        .vertexCount = static_cast<uint32_t>(vertexCount),
+        .firstIndex = static_cast<uint32_t>(firstIndex.value()),
+        .indexCount = static_cast<uint32_t>(indexCount),
+    };
+}
+
+UploadTicket GeometryPool::upload(Buffers& buffers, GeometryRange range, common::Mesh* mesh)
+{
+    UploadTicket ticket = 0;
+    if(range.vertexCount > 0)
+        ticket = resourceManager->uploadBuffer(buffers.vertexBuffer,
+                                               range.vertexCount * sizeof(common::Vertex),
+                                               mesh->vertices.data(),
+                                               range.vertexOffset * sizeof(common::Vertex));
+    if(range.indexCount > 0)
+        ticket = resourceManager->uploadBuffer(buffers.indexBuffer,
+                                               range.indexCount * sizeof(uint32_t),
+                                               mesh->indices.data(),
+                                               range.firstIndex * sizeof(uint32_t));
+    return ticket;
+}
+
+GeometryId GeometryPool::add(common::Mesh* mesh, UploadTicket& uploadTicket)
+{
+    static GeometryId id = 0;
+    id++;
+
+    uint64_t vertexCount = mesh->vertices.size();
+    uint64_t indexCount = mesh->indices.size();
+    //With a copy in flight the mesh goes in both, it is drawn from the current
+    //buffers until the copy is done and the ranges being copied are left alone
+    auto range = allocate(current, vertexCount, indexCount);
+    std::optional<GeometryRange> pendingRange;
+    if(range.has_value() && pending.has_value()){
+        pendingRange = allocate(pending->buffers, vertexCount, indexCount);
+        if(!pendingRange.has_value()){
+            current.vertices.free(range->vertexOffset, vertexCount);
+            current.indices.free(range->firstIndex, indexCount);
+            range.reset();
+        }
+    }
+    if(!range.has_value()){
+        //Grow, the live ranges get packed on the way. Only this waits on a copy in flight.
+        finishCompaction(true);
+        compact(std::max(current.vertices.getCapacity() * 2, current.vertices.getUsed() + vertexCount),
+                std::max(current.indices.getCapacity() * 2, current.indices.getUsed() + indexCount));
+        finishCompaction(true);
+        range = allocate(current, vertexCount, indexCount);
+    }
+
+    current.ranges[id] = range.value();
+    uploadTicket = upload(current, range.value(), mesh);
+    if(pendingRange.has_value()){
+        pending->buffers.ranges[id] = pendingRange.value();
+        uploadTicket = upload(pending->buffers, pendingRange.value(), mesh);
+    }
+    return id;
+}
+
+void GeometryPool::remove(GeometryId id)
+{
+    auto it = current.ranges.find(id);
+    if(it == current.ranges.end())
+        return;
+    //Frames in flight may still draw it, the range is reused once they are done
+    freed.push_back(Freed{
+        .range = it->second,
+        .frameNumber = frameNumber,
+    });
+    current.ranges.erase(it);
+    //The copy in flight has it too, the range there is freed once those buffers are current
+    if(pending.has_value()){
+        auto pendingIt = pending->buffers.ranges.find(id);
+        if(pendingIt != pending->buffers.ranges.end()){
+            pending->freed.push_back(pendingIt->second);
+            pending->buffers.ranges.erase(pendingIt);
+        }
+    }
+}
+
+GeometryRange GeometryPool::getRange(GeometryId id)
+{
+    return current.ranges[id];
+}
+
+vk::Buffer GeometryPool::getVertexBuffer()
+{
+    return resourceManager->getBuffer(current.vertexBuffer);
+}
+
+vk::Buffer GeometryPool::getIndexBuffer()
+{
+    return resourceManager->getBuffer(current.indexBuffer);
+}
+
+uint64_t GeometryPool::getGeneration()
+{
+    return generation;
+}
+
+void GeometryPool::compact(uint64_t vertexCapacity, uint64_t indexCapacity)
+{
+    auto buffers = createBuffers(vertexCapacity, indexCapacity);
+    std::vector<vk::BufferCopy> vertexCopies;
+    std::vector<vk::BufferCopy> indexCopies;
+    for(auto& [id, range] : current.ranges){
+        auto packed = range;
+        packed.vertexOffset = static_cast<uint32_t>(buffers.vertices.allocate(range.vertexCount).value());
+        packed.firstIndex = static_cast<uint32_t>(buffers.indices.allocate(range.indexCount).value());
+        //Indices are relative to vertexOffset, so they are copied as they are
+        if(range.vertexCount > 0)
+            vertexCopies.push_back(vk::BufferCopy{
+                .srcOffset = range.vertexOffset * sizeof(common::Vertex),
+                .dstOffset = packed.vertexOffset * sizeof(common::Vertex),
+                .size = range.vertexCount * sizeof(common::Vertex),
+            });
+        if(range.indexCount > 0)
+            indexCopies.push_back(vk::BufferCopy{
+                .srcOffset = range.firstIndex * sizeof(uint32_t),
+                .dstOffset = packed.firstIndex * sizeof(uint32_t),
+                .size = range.indexCount * sizeof(uint32_t),
+            });
+        buffers.ranges[id] = packed;
+    }
+    resourceManager->copyBufferRegions(current.vertexBuffer, buffers.vertexBuffer, vertexCopies);
+    auto ticket = resourceManager->copyBufferRegions(current.indexBuffer, buffers.indexBuffer, indexCopies);
+    pending = Compaction{
+        .buffers = std::move(buffers),
+        .ticket = ticket,
+    };
+}
+
+void GeometryPool::finishCompaction(bool wait)
+{
+    if(!pending.has_value())
+        return;
+    if(wait)
+        resourceManager->waitUpload(pending->ticket);
+    else if(!resourceManager->isUploaded(pending->ticket))
+        return;
+
+    retired.push_back(Retired{
+        .vertexBuffer = current.vertexBuffer,
+        .indexBuffer = current.indexBuffer,
+        .frameNumber = frameNumber,
+    });
+    current = std::move(pending->buffers);
+    //What is still waiting in freed belongs to the old buffers, the new ones never had it
+    freed.clear();
+    for(auto& range : pending->freed)
+        freed.push_back(Freed{
+            .range = range,
+            .frameNumber = frameNumber,
+        });
+    pending.reset();
+    generation++;
+    compactions++;
+}
+
+void GeometryPool::beginFrame(uint64_t frameNumber)
+{
+    this->frameNumber = frameNumber;
+    finishCompaction(false);
+    while(!retired.empty() && retired.front().frameNumber + framesInFlight <= frameNumber){
+        resourceManager->destroyBuffer(retired.front().vertexBuffer);
+        resourceManager->destroyBuffer(retired.front().indexBuffer);
+        retired.pop_front();
+    }
+    while(!freed.empty() && freed.front().frameNumber + framesInFlight <= frameNumber){
+        auto& range = freed.front().range;
+        current.vertices.free(range.vertexOffset, range.vertexCount);
+        current.indices.free(range.firstIndex, range.indexCount);
+        freed.pop_front();
+    }
+
+    if(!pending.has_value() &&
+       (current.vertices.getFragmented() * geometryCompactionDivisor > current.vertices.getCapacity() ||
+        current.indices.getFragmented() * geometryCompactionDivisor > current.indices.getCapacity()))
+        compact(current.vertices.getCapacity(), current.indices.getCapacity());
+}
+
+GeometryStats GeometryPool::getStats()
+{
+    return GeometryStats{
+        .vertexCapacity = current.vertices.getCapacity(),
+        .vertexUsed = current.vertices.getUsed(),
+        .indexCapacity = current.indices.getCapacity(),
+        .indexUsed = current.indices.getUsed(),
+        .compactions = compactions,
+        .generation = generation,
+    };
+}
+
+
+/*##################### DescriptorManager methods ####################################*/
+const uint32_t firstDescriptorPoolSize = 256;
+const uint32_t maxDescriptorPoolSize = 16384;
+const uint32_t descriptorSetBatchSize = 64;
+//Descriptors of each type per set in a pool, a layout that needs more gets a pool sized for it
+const uint32_t descriptorsPerSet = 4;
+
+DescriptorManager::DescriptorManager(vk::Device device, uint32_t framesInFlight) :
+    device(device), framesInFlight(framesInFlight), nextPoolSize(firstDescriptorPoolSize)
+{
+    //ImGui allocates from this one, so it is kept out of the chain
+    std::vector<vk::DescriptorPoolSize> poolSizes{
+        {vk::DescriptorType::eUniformBuffer, 16},
+        {vk::DescriptorType::eCombinedImageSampler, 16},
+    };
+    vk::DescriptorPoolCreateInfo createPoolInfo {
+        .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+        .maxSets = static_cast<uint32_t>(16),
+        .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+        .pPoolSizes = poolSizes.data(),
+    };
+    imguiPool = device.createDescriptorPool(createPoolInfo);
+
+    createPool(nextPoolSize);
+}
+
+void DescriptorManager::createPool(uint32_t maxSets, const DescriptorSetLayout* layout)
+{
+    //Every type reflection can produce, plus the dynamic uniforms of the object ring
+    std::map<vk::DescriptorType, uint32_t> perSet{
+        {vk::DescriptorType::eUniformBuffer, descriptorsPerSet},
+        {vk::DescriptorType::eUniformBufferDynamic, descriptorsPerSet},
+        {vk::DescriptorType::eStorageBuffer, descriptorsPerSet},
+        {vk::DescriptorType::eCombinedImageSampler, descriptorsPerSet},
+        {vk::DescriptorType::eSampledImage, descriptorsPerSet},
+        {vk::DescriptorType::eSampler, descriptorsPerSet},
+        {vk::DescriptorType::eStorageImage, descriptorsPerSet},
+    };
+    if(layout){
+        std::map<vk::DescriptorType, uint32_t> needed;
+        for(auto& binding : layout->bindings)
+            needed[binding.descriptorType] += binding.descriptorCount;
+        for(auto& [type, count] : needed)
+            perSet[type] = std::max(perSet[type], count);
+    }
+    std::vector<vk::DescriptorPoolSize> poolSizes;
+    PoolCapacity capacity{
+        .sets = maxSets,
+    };
+    for(auto& [type, count] : perSet){
+        poolSizes.push_back({type, maxSets * count});
+        capacity.descriptors[type] = maxSets * count;
+    }
+
+    vk::DescriptorPoolCreateInfo createPoolInfo {
+        .maxSets = maxSets,
+        .poolSizeCount = static_cast<uint32_t>(poolSizes.size()),
+        .pPoolSizes = poolSizes.data(),
+    };
+    capacity.pool = device.createDescriptorPool(createPoolInfo);
+    pools.push_back(capacity);
+    stats.pools++;
+    nextPoolSize = std::min(nextPoolSize * 2, maxDescriptorPoolSize);
+}
+
+bool DescriptorManager::fits(PoolCapacity& pool, DescriptorSetLayout& layout, uint32_t noSets)
+{
+    if(pool.sets < noSets)
+        return false;
+    std::map<vk::DescriptorType, uint32_t> needed;
+    for(auto& binding : layout.bindings)
+        needed[binding.descriptorType] += binding.descriptorCount * noSets;
+    for(auto& [type, count] : needed){
+        if(pool.descriptors[type] < count)
+            return false;
+    }
+    for(auto& [type, count] : needed)
+        pool.descriptors[type] -= count;
+    pool.sets -= noSets;
+    return true;
+}
+
+bool sameBindings(const std::vector<vk::DescriptorSetLayoutBinding>& a,
+                  const std::vector<vk::DescriptorSetLayoutBinding>& b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t i = 0; i < a.size(); i++){
+        if(a[i].binding != b[i].binding ||
+           a[i].descriptorType != b[i].descriptorType ||
+           a[i].descriptorCount != b[i].descriptorCount ||
+           a[i].stageFlags != b[i].stageFlags ||
+           (a[i].pImmutableSamplers == nullptr) != (b[i].pImmutableSamplers == nullptr))
+            return false;
+        for(uint32_t sampler = 0; a[i].pImmutableSamplers && sampler < a[i].descriptorCount; sampler++)
+            if(a[i].pImmutableSamplers[sampler] != b[i].pImmutableSamplers[sampler])
+                return false;
+    }
+    return true;
+}
+
+DSLayoutId DescriptorManager::CreateLayout(std::vector<vk::DescriptorSetLayoutBinding> bindings)
+{
+    uint64_t hash = hashSeed;
+    for(auto& binding : bindings){
+        hash = hashCombine(hash, binding.binding);
+        hash = hashCombine(hash, (uint64_t)binding.descriptorType);
+        hash = hashCombine(hash, binding.descriptorCount);
+        hash = hashCombine(hash, (uint64_t)(VkShaderStageFlags)binding.stageFlags);
+        for(uint32_t i = 0; binding.pImmutableSamplers && i < binding.descriptorCount; i++)
+            hash = hashCombine(hash, (uint64_t)(VkSampler)binding.pImmutableSamplers[i]);
+    }
+    //The hash only narrows it down, a collision must not hand out another layout
+    auto [first, last] = layoutsByHash.equal_range(hash);
+    for(auto it = first; it != last; it++){
+        if(sameBindings(layouts[it->second].bindings, bindings))
+            return it->second;
+    }
+
+    vk::DescriptorSetLayoutCreateInfo layoutCreateInfo{
+        .bindingCount = static_cast<uint32_t>(bindings.size()),
+        .pBindings = bindings.data(),
+    };
+
+    static DSLayoutId id = 0;
+    auto _layout = device.createDescriptorSetLayout(layoutCreateInfo);
+    DescriptorSetLayout layout = {
+        .layoutId = id,
+        .DSLayout = _layout,
+        .bindings = bindings,
+    };
+    layouts[id] = layout;
+    layoutsByHash.emplace(hash, id);
+    freeDescriptorsByLayout[id] = std::stack<DescriptorSet>();
+    return id++;
+}
+
+vk::DescriptorSetLayout DescriptorManager::getDSLayout(DSLayoutId id)
+{
+    return layouts[id].DSLayout;
 }
 
 std::vector<vk::DescriptorSetLayout> DescriptorManager::getDSLayouts(std::vector<DSLayoutId> ids)
@@ -570,18 +1612,46 @@ std::vector<vk::DescriptorSetLayout> DescriptorManager::getDSLayouts(std::vector
     return DSLayouts;
 }
 
+std::vector<vk::DescriptorSetLayoutBinding> DescriptorManager::getLayoutBindings(DSLayoutId id)
+{
+    return layouts[id].bindings;
+}
+
 void DescriptorManager::preAllocateDescriptorSets(DSLayoutId layoutId, uint32_t noSets)
 {
-    auto layout = layouts[layoutId].DSLayout;
-    std::vector<vk::DescriptorSetLayout> layouts(noSets, layout);
-    vk::DescriptorSetAllocateInfo DSAllocInfo{
-        .descriptorPool = pool,
-        .descriptorSetCount = noSets,
-        .pSetLayouts = layouts.data(),
+    auto& layout = layouts[layoutId];
+    std::vector<vk::DescriptorSetLayout> setLayouts(noSets, layout.DSLayout);
+    auto allocate = [&]() -> std::vector<vk::DescriptorSet> {
+        vk::DescriptorSetAllocateInfo DSAllocInfo{
+            .descriptorPool = pools.back().pool,
+            .descriptorSetCount = noSets,
+            .pSetLayouts = setLayouts.data(),
+        };
+        try{
+            return device.allocateDescriptorSets(DSAllocInfo);
+        }
+        //Shouldn't happen since we count the descriptors, but drivers can still fragment
+        catch(vk::OutOfPoolMemoryError&){}
+        catch(vk::FragmentedPoolError&){}
+        pools.back().sets = 0;
+        return {};
     };
 
+    std::vector<vk::DescriptorSet> descriptorSets;
+    if(fits(pools.back(), layout, noSets))
+        descriptorSets = allocate();
+    //A fresh pool sized for the layout, if that fails too nothing else will help
+    if(descriptorSets.empty()){
+        createPool(std::max(nextPoolSize, noSets), &layout);
+        if(fits(pools.back(), layout, noSets))
+            descriptorSets = allocate();
+        if(descriptorSets.empty()){
+            std::cout << "ERROR::preAllocateDescriptorSets => Couldn't allocate descriptor sets from a new pool." << std::endl;
+            exit(0);
+        }
+    }
+
     static DSId id = 0;
-    auto descriptorSets = device.allocateDescriptorSets(DSAllocInfo);
     for(auto& descriptorSet : descriptorSets){
         auto set =  DescriptorSet{
             .id = id,
@@ -593,98 +1663,120 @@ void DescriptorManager::preAllocateDescriptorSets(DSLayoutId layoutId, uint32_t
         freeDescriptorsByLayout[layoutId].push(set);
         id++;
     }
+    stats.setsAllocated += noSets;
 }
 
 DSId DescriptorManager::getFreeDS(DSLayoutId id)
 {
-    //TODO: make it fail gracefully when there is no more free descriptors
-    //Today it just crashes with no message.
-    DescriptorSet descriptor = freeDescriptorsByLayout[id].top();
-    freeDescriptorsByLayout[id].pop();
+    auto& freeDescriptors = freeDescriptorsByLayout[id];
+    if(freeDescriptors.empty())
+        preAllocateDescriptorSets(id, descriptorSetBatchSize);
+    DescriptorSet descriptor = freeDescriptors.top();
+    freeDescriptors.pop();
     return descriptor.id;
 }
 
 DSId DescriptorManager::writeDS(DSLayoutId id, std::vector<WriteDescriptorInfo> writeInfos)
 {
-    DescriptorSet descriptor = freeDescriptorsByLayout[id].top();
-    freeDescriptorsByLayout[id].pop();
-    DescriptorSetLayout layout = layouts[descriptor.layoutId];
+    auto descriptorId = getFreeDS(id);
+    updateDS(descriptorId, writeInfos);
+    return descriptorId;
+}
+
+void DescriptorManager::updateDS(DSId id, std::vector<WriteDescriptorInfo> writeInfos)
+{
+    DescriptorSet descriptor = descriptors[id];
+    DescriptorSetLayout& layout = layouts[descriptor.layoutId];
     if(writeInfos.size() != layout.bindings.size()){
-        std::cout << "ERROR::writeDS => Layout has " << layout.bindings.size()
+        std::cout << "ERROR::updateDS => Layout has " << layout.bindings.size()
                   << " bindings but only " << writeInfos.size() << " write infos provided." << std::endl;
         exit(0);
     }
 
-    std::vector<vk::WriteDescriptorSet> writes;
-    for(int i = 0; i < layout.bindings.size(); i++){
-        auto binding = layout.bindings[i];
-        if(binding.descriptorType == vk::DescriptorType::eUniformBuffer){
-            vk::WriteDescriptorSet write = {
-                .dstSet = descriptor.descriptorSet,
-                .dstBinding = binding.binding,
-                .dstArrayElement = 0,
-                .descriptorCount = binding.descriptorCount,
-                .descriptorType = binding.descriptorType,
-                .pBufferInfo = &writeInfos[i].bufferInfo.value(),
-            };
-            writes.push_back(write);
+    uint64_t hash = hashSeed;
+    for(auto& writeInfo : writeInfos){
+        if(writeInfo.bufferInfo.has_value()){
+            auto& info = writeInfo.bufferInfo.value();
+            hash = hashCombine(hash, (uint64_t)(VkBuffer)info.buffer);
+            hash = hashCombine(hash, info.offset);
+            hash = hashCombine(hash, info.range);
         }
-        else if(binding.descriptorType == vk::DescriptorType::eCombinedImageSampler){
-            vk::WriteDescriptorSet write = {
-                .dstSet = descriptor.descriptorSet,
-                .dstBinding = binding.binding,
-                .dstArrayElement = 0,
-                .descriptorCount = binding.descriptorCount,
-                .descriptorType = binding.descriptorType,
-                .pImageInfo = &writeInfos[i].imageInfo.value(),
-            };
-            writes.push_back(write);
+        if(writeInfo.imageInfo.has_value()){
+            auto& info = writeInfo.imageInfo.value();
+            hash = hashCombine(hash, (uint64_t)(VkSampler)info.sampler);
+            hash = hashCombine(hash, (uint64_t)(VkImageView)info.imageView);
+            hash = hashCombine(hash, (uint64_t)info.imageLayout);
         }
     }
-    device.updateDescriptorSets(writes, nullptr);
-
-    return descriptor.id;
-}
-
-void DescriptorManager::updateDS(DSId id, std::vector<WriteDescriptorInfo> writeInfos)
-{
-    DescriptorSet descriptor = descriptors[id];
-    DescriptorSetLayout layout = layouts[descriptor.layoutId];
+    auto it = contentHashes.find(id);
+    if(it != contentHashes.end() && it->second == hash){
+        stats.writesSkipped += layout.bindings.size();
+        return;
+    }
+    contentHashes[id] = hash;
 
-    std::vector<vk::WriteDescriptorSet> writes;
     for(int i = 0; i < layout.bindings.size(); i++){
         auto binding = layout.bindings[i];
-        if(binding.descriptorType == vk::DescriptorType::eUniformBuffer){
-            vk::WriteDescriptorSet write = {
-                .dstSet = descriptor.descriptorSet,
-                .dstBinding = binding.binding,
-                .dstArrayElement = 0,
-                .descriptorCount = binding.descriptorCount,
-                .descriptorType = binding.descriptorType,
-                .pBufferInfo = &writeInfos[i].bufferInfo.value(),
-            };
-            writes.push_back(write);
+        vk::WriteDescriptorSet write = {
+            .dstSet = descriptor.descriptorSet,
+            .dstBinding = binding.binding,
+            .dstArrayElement = 0,
+            .descriptorCount = binding.descriptorCount,
+            .descriptorType = binding.descriptorType,
+        };
+        if(binding.descriptorType == vk::DescriptorType::eUniformBuffer ||
+           binding.descriptorType == vk::DescriptorType::eUniformBufferDynamic ||
+           binding.descriptorType == vk::DescriptorType::eStorageBuffer){
+            pendingBufferInfos.push_back(writeInfos[i].bufferInfo.value());
+            write.pBufferInfo = &pendingBufferInfos.back();
         }
-        else if(binding.descriptorType == vk::DescriptorType::eCombinedImageSampler){
-            vk::WriteDescriptorSet write = {
-                .dstSet = descriptor.descriptorSet,
-                .dstBinding = binding.binding,
-                .dstArrayElement = 0,
-                .descriptorCount = binding.descriptorCount,
-                .descriptorType = binding.descriptorType,
-                .pImageInfo = &writeInfos[i].imageInfo.value(),
-            };
-            writes.push_back(write);
+        else if(binding.descriptorType == vk::DescriptorType::eCombinedImageSampler ||
+                binding.descriptorType == vk::DescriptorType::eStorageImage){
+            pendingImageInfos.push_back(writeInfos[i].imageInfo.value());
+            write.pImageInfo = &pendingImageInfos.back();
         }
+        else{
+            continue;
+        }
+        pendingWrites.push_back(write);
     }
+}
 
-    device.updateDescriptorSets(writes, nullptr);
+void DescriptorManager::flushUpdates()
+{
+    if(pendingWrites.empty())
+        return;
+    device.updateDescriptorSets(pendingWrites, nullptr);
+    stats.writesIssued += pendingWrites.size();
+    stats.updateCalls++;
+    pendingWrites.clear();
+    pendingBufferInfos.clear();
+    pendingImageInfos.clear();
 }
 
 void DescriptorManager::freeDS(DSId id)
 {
-    DescriptorSet descriptor = descriptors[id];
-    freeDescriptorsByLayout[descriptor.layoutId].push(descriptor);
+    //The set can still be used by a frame in flight
+    retiringSets.push_back(RetiringSet{
+        .descriptor = descriptors[id],
+        .frameNumber = frameNumber,
+    });
+}
+
+void DescriptorManager::beginFrame(uint64_t frameNumber)
+{
+    this->frameNumber = frameNumber;
+    while(!retiringSets.empty() && retiringSets.front().frameNumber + framesInFlight <= frameNumber){
+        auto& descriptor = retiringSets.front().descriptor;
+        contentHashes.erase(descriptor.id);
+        freeDescriptorsByLayout[descriptor.layoutId].push(descriptor);
+        retiringSets.pop_front();
+    }
+}
+
+DescriptorStats DescriptorManager::getStats()
+{
+    return stats;
 }
 
 vk::DescriptorSet DescriptorManager::getDS(DSId id)
@@ -694,29 +1786,503 @@ vk::DescriptorSet DescriptorManager::getDS(DSId id)
 
 vk::DescriptorPool DescriptorManager::getDescriptorPool()
 {
-    return pool;
+    return imguiPool;
 }
 
 
 /*############################### Pipeline manager Methods #################################*/
-PipelineManager::PipelineManager(vk::Device device, DescriptorManager* descriptorManager) : device(device), descriptorManager(descriptorManager)
+/*###################### ShaderRegistry methods ######################################*/
+ShaderRegistry::ShaderRegistry(vk::Device device) : device(device)
 {}
 
+ShaderRegistry::ShaderFile ShaderRegistry::statFile(const std::string& path)
+{
+    struct stat fileStat;
+    if(stat(path.c_str(), &fileStat) != 0 || fileStat.st_size == 0)
+        throw std::runtime_error("Erro ao ler arquivo " + path);
+    return ShaderFile{
+        .modifiedTime = fileStat.st_mtim.tv_sec * 1000000000ll + fileStat.st_mtim.tv_nsec,
+        .size = static_cast<size_t>(fileStat.st_size),
+    };
+}
+
+//Maps the file, hashes and reflects it. With a module it also creates the vk::ShaderModule
+//when no other file had the same contents.
+void ShaderRegistry::mapFile(const std::string& path, ShaderFile& file, std::optional<vk::ShaderModule>* module)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Erro ao ler arquivo " + path);
+    void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        throw std::runtime_error("Erro ao mapear arquivo " + path);
+    stats.filesMapped++;
+    stats.bytesMapped += file.size;
+
+    try{
+        file.contentHash = hashBytes(data, file.size);
+        file.reflection = reflectSpirv(reinterpret_cast<const uint32_t*>(data), file.size / sizeof(uint32_t));
+        if(module && !modules.count(file.contentHash)){
+            //the driver copies the code, the mapping is not needed after this
+            *module = device.createShaderModule(vk::ShaderModuleCreateInfo{
+                .codeSize = file.size,
+                .pCode = reinterpret_cast<const uint32_t*>(data),
+            });
+        }
+    }
+    catch(...){
+        munmap(data, file.size);
+        throw;
+    }
+    munmap(data, file.size);
+}
+
+vk::ShaderModule ShaderRegistry::acquire(const std::string& path)
+{
+    auto current = statFile(path);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& file = files[path];
+    //Unchanged files whose module is still alive are not read again
+    std::optional<vk::ShaderModule> created;
+    if(current.modifiedTime != file.modifiedTime || current.size != file.size || !modules.count(file.contentHash)){
+        mapFile(path, current, &created);
+        file = current;
+    }
+
+    if(created.has_value()){
+        modules[file.contentHash] = ShaderModule{.module = created.value(), .references = 0};
+        hashesByModule[static_cast<VkShaderModule>(created.value())] = file.contentHash;
+        stats.modulesCreated++;
+    }
+    else
+        stats.modulesReused++;
+
+    auto& shaderModule = modules[file.contentHash];
+    shaderModule.references++;
+    return shaderModule.module;
+}
+
+ShaderReflection ShaderRegistry::reflect(const std::string& path)
+{
+    auto current = statFile(path);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& file = files[path];
+    if(current.modifiedTime != file.modifiedTime || current.size != file.size){
+        mapFile(path, current, nullptr);
+        file = current;
+    }
+    return file.reflection;
+}
+
+void ShaderRegistry::release(vk::ShaderModule module)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = hashesByModule.find(static_cast<VkShaderModule>(module));
+    if(it == hashesByModule.end())
+        return;
+    auto& shaderModule = modules[it->second];
+    if(--shaderModule.references > 0)
+        return;
+
+    device.destroyShaderModule(module);
+    modules.erase(it->second);
+    hashesByModule.erase(it);
+    stats.modulesDestroyed++;
+}
+
+ShaderStats ShaderRegistry::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+
+PipelineManager::PipelineManager(vk::Device device, DescriptorManager* descriptorManager,
+                                 common::ThreadPool* threadPool, uint32_t framesInFlight) :
+    device(device), descriptorManager(descriptorManager), threadPool(threadPool), framesInFlight(framesInFlight)
+{
+    shaderRegistry = new ShaderRegistry(device);
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd < 0)
+        std::cout << "[📃] PipelineManager: inotify unavailable, shader hot reload disabled" << std::endl;
+}
+
+uint64_t hashString(const std::string& string, uint64_t hash = hashSeed)
+{
+    return hashCombine(hashBytes(string.data(), string.size(), hash), string.size());
+}
+
+uint64_t PipelineManager::hashPipelineInfo(PipelineInfo& info)
+{
+    uint64_t hash = hashString(info.vertexShaderPath);
+    hash = hashString(info.fragmentShaderPath, hash);
+    hash = hashCombine(hash, (uint64_t)info.pipelineCreateInfo.cullMode);
+    hash = hashCombine(hash, (uint64_t)info.pipelineCreateInfo.frontFace);
+    for(auto& [constant, value] : info.pipelineCreateInfo.specializationConstants){
+        hash = hashCombine(hash, (uint64_t)constant);
+        hash = hashCombine(hash, value);
+    }
+    for(auto& bind : info.vertexBinds){
+        hash = hashCombine(hash, bind.binding);
+        hash = hashCombine(hash, bind.stride);
+        hash = hashCombine(hash, (uint64_t)bind.inputRate);
+    }
+    for(auto& attrib : info.vertexAttribs){
+        hash = hashCombine(hash, attrib.location);
+        hash = hashCombine(hash, attrib.binding);
+        hash = hashCombine(hash, (uint64_t)attrib.format);
+        hash = hashCombine(hash, attrib.offset);
+    }
+    for(auto& range : info.pushConstantRanges){
+        hash = hashCombine(hash, (uint64_t)(VkShaderStageFlags)range.stageFlags);
+        hash = hashCombine(hash, range.offset);
+        hash = hashCombine(hash, range.size);
+    }
+    hash = hashCombine(hash, info.depthStencilStateCreateInfo.has_value());
+    if(info.depthStencilStateCreateInfo.has_value()){
+        auto& depth = info.depthStencilStateCreateInfo.value();
+        hash = hashCombine(hash, depth.depthTestEnable);
+        hash = hashCombine(hash, depth.depthWriteEnable);
+        hash = hashCombine(hash, (uint64_t)depth.depthCompareOp);
+        hash = hashCombine(hash, depth.depthBoundsTestEnable);
+        hash = hashCombine(hash, depth.stencilTestEnable);
+    }
+    hash = hashCombine(hash, (uint64_t)(VkSampler)info.sampler);
+    hash = hashCombine(hash, (uint64_t)(VkRenderPass)info.renderPass);
+    if(info.layoutIds.has_value()){
+        for(auto& layoutId : info.layoutIds.value())
+            hash = hashCombine(hash, layoutId);
+    }
+    return hash;
+}
+
+//Everything hashPipelineInfo hashes, checked on a hash hit
+bool samePipelineInfo(const PipelineManager::PipelineInfo& a, const PipelineManager::PipelineInfo& b)
+{
+    if(a.depthStencilStateCreateInfo.has_value() != b.depthStencilStateCreateInfo.has_value())
+        return false;
+    if(a.depthStencilStateCreateInfo.has_value()){
+        auto& depthA = a.depthStencilStateCreateInfo.value();
+        auto& depthB = b.depthStencilStateCreateInfo.value();
+        if(depthA.depthTestEnable != depthB.depthTestEnable ||
+           depthA.depthWriteEnable != depthB.depthWriteEnable ||
+           depthA.depthCompareOp != depthB.depthCompareOp ||
+           depthA.depthBoundsTestEnable != depthB.depthBoundsTestEnable ||
+           depthA.stencilTestEnable != depthB.stencilTestEnable)
+            return false;
+    }
+    return a.vertexShaderPath == b.vertexShaderPath &&
+           a.fragmentShaderPath == b.fragmentShaderPath &&
+           a.pipelineCreateInfo.cullMode == b.pipelineCreateInfo.cullMode &&
+           a.pipelineCreateInfo.frontFace == b.pipelineCreateInfo.frontFace &&
+           a.pipelineCreateInfo.specializationConstants == b.pipelineCreateInfo.specializationConstants &&
+           a.vertexBinds == b.vertexBinds &&
+           a.vertexAttribs == b.vertexAttribs &&
+           a.pushConstantRanges == b.pushConstantRanges &&
+           a.sampler == b.sampler &&
+           a.renderPass == b.renderPass &&
+           a.layoutIds == b.layoutIds;
+}
+
+std::optional<PipelineID> PipelineManager::findPipeline(PipelineInfo& info, uint64_t pipelineHash)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [first, last] = pipelinesByHash.equal_range(pipelineHash);
+    for(auto it = first; it != last; it++){
+        if(samePipelineInfo(pipelineInfos[it->second], info)){
+            stats.pipelinesReused++;
+            return it->second;
+        }
+    }
+    return std::nullopt;
+}
+
+vk::PipelineLayout PipelineManager::getPipelineLayout(std::vector<DSLayoutId> layoutIds, std::vector<vk::PushConstantRange> pushConstantRanges)
+{
+    uint64_t hash = hashSeed;
+    for(auto& layoutId : layoutIds)
+        hash = hashCombine(hash, layoutId);
+    for(auto& range : pushConstantRanges){
+        hash = hashCombine(hash, (uint64_t)(VkShaderStageFlags)range.stageFlags);
+        hash = hashCombine(hash, range.offset);
+        hash = hashCombine(hash, range.size);
+    }
+    auto [first, last] = pipelineLayouts.equal_range(hash);
+    for(auto it = first; it != last; it++){
+        if(it->second.layoutIds == layoutIds && it->second.pushConstantRanges == pushConstantRanges)
+            return it->second.layout;
+    }
+
+    auto layouts = descriptorManager->getDSLayouts(layoutIds);
+    vk::PipelineLayoutCreateInfo layoutCreateInfo{
+        .setLayoutCount = static_cast<uint32_t>(layouts.size()),
+        .pSetLayouts = layouts.data(),
+        .pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size()),
+        .pPushConstantRanges = pushConstantRanges.data(),
+    };
+    auto layout = device.createPipelineLayout(layoutCreateInfo);
+    pipelineLayouts.emplace(hash, CachedPipelineLayout{
+        .layoutIds = layoutIds,
+        .pushConstantRanges = pushConstantRanges,
+        .layout = layout,
+    });
+    return layout;
+}
+
+const uint32_t pipelineCacheMagic = 0x4350594d; //"MYPC"
+const uint32_t pipelineCacheVersion = 1;
+
+void PipelineManager::loadPipelineCache(const std::string& path, vk::PhysicalDeviceProperties properties)
+{
+    pipelineCachePath = path;
+    cacheHeader = PipelineCacheHeader{
+        .magic = pipelineCacheMagic,
+        .version = pipelineCacheVersion,
+        .vendorID = properties.vendorID,
+        .deviceID = properties.deviceID,
+        .driverVersion = properties.driverVersion,
+    };
+    std::copy(std::begin(properties.pipelineCacheUUID), std::end(properties.pipelineCacheUUID), cacheHeader.pipelineCacheUUID);
+
+    std::vector<char> data;
+    std::ifstream file(path, std::ios::binary);
+    PipelineCacheHeader fileHeader;
+    if(file.is_open() && file.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader))){
+        bool valid = fileHeader.magic == cacheHeader.magic
+            && fileHeader.version == cacheHeader.version
+            && fileHeader.vendorID == cacheHeader.vendorID
+            && fileHeader.deviceID == cacheHeader.deviceID
+            && fileHeader.driverVersion == cacheHeader.driverVersion
+            && std::equal(std::begin(fileHeader.pipelineCacheUUID), std::end(fileHeader.pipelineCacheUUID), cacheHeader.pipelineCacheUUID);
+        if(valid){
+            //A damaged header could ask for any size, only what the file holds is read
+            auto dataStart = file.tellg();
+            file.seekg(0, std::ios::end);
+            auto remaining = static_cast<uint64_t>(file.tellg() - dataStart);
+            file.seekg(dataStart);
+            if(fileHeader.dataSize <= remaining)
+                data.resize(fileHeader.dataSize);
+            if(data.size() != fileHeader.dataSize ||
+               !file.read(data.data(), data.size()) || hashBytes(data.data(), data.size()) != fileHeader.dataHash){
+                std::cout << "Pipeline cache: " << path << " is corrupted, starting cold." << std::endl;
+                data.clear();
+            }
+        }
+        else{
+            std::cout << "Pipeline cache: " << path << " is from another device/driver, starting cold." << std::endl;
+        }
+    }
+
+    vk::PipelineCacheCreateInfo createInfo{
+        .initialDataSize = data.size(),
+        .pInitialData = data.data(),
+    };
+    pipelineCache = device.createPipelineCache(createInfo);
+    stats.cacheWarm = !data.empty();
+    stats.cacheBytesLoaded = data.size();
+}
+
+void PipelineManager::savePipelineCache()
+{
+    if(!pipelineCache || pipelineCachePath.empty())
+        return;
+
+    auto data = device.getPipelineCacheData(pipelineCache);
+    PipelineCacheHeader header = cacheHeader;
+    header.dataSize = data.size();
+    header.dataHash = hashBytes(data.data(), data.size());
+
+    //Write to a temporary file first so a crash can't leave half a cache behind
+    std::string tmpPath = pipelineCachePath + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if(!file.is_open()){
+        std::cout << "Pipeline cache: couldn't write " << tmpPath << std::endl;
+        return;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
+    std::rename(tmpPath.c_str(), pipelineCachePath.c_str());
+}
+
+vk::PipelineCache PipelineManager::getPipelineCache()
+{
+    return pipelineCache;
+}
+
+PipelineStats PipelineManager::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+PipelineID PipelineManager::registerPipeline(PipelineInfo& info, uint64_t pipelineHash)
+{
+    //Layouts go through the DescriptorManager, so they are made on the caller thread
+    auto layout = getPipelineLayout(info.layoutIds.value_or(std::vector<DSLayoutId>{}), info.pushConstantRanges);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto pipelineId = nextPipelineId++;
+    pipelines[pipelineId] = Pipeline{
+	.pipeline = nullptr,
+	.pipelineLayout = layout,
+	.sampler = info.sampler,
+        .descriptorLayout = info.layoutIds.value()[0],
+        .ready = false,
+    };
+    if(!info.pushConstantRanges.empty())
+        pipelines[pipelineId].pushConstants = info.pushConstantRanges[0];
+    pipelinesByHash.emplace(pipelineHash, pipelineId);
+    pipelineInfos[pipelineId] = info;
+    watchShader(info.vertexShaderPath, pipelineId);
+    watchShader(info.fragmentShaderPath, pipelineId);
+    return pipelineId;
+}
+
 PipelineID PipelineManager::CreatePipeline(PipelineInfo info)
 {
-    auto fragmentShader = compileShaderModule(readFile(info.fragmentShaderPath));
-    auto vertexShader = compileShaderModule(readFile(info.vertexShaderPath));
+    //Shader contents are not part of the key, same paths are the same shaders
+    auto pipelineHash = hashPipelineInfo(info);
+    if(auto existing = findPipeline(info, pipelineHash))
+        return existing.value();
+
+    auto id = registerPipeline(info, pipelineHash);
+    buildPipeline(id, info);
+    return id;
+}
+
+PipelineID PipelineManager::CreatePipelineAsync(PipelineInfo info)
+{
+    auto pipelineHash = hashPipelineInfo(info);
+    if(auto existing = findPipeline(info, pipelineHash))
+        return existing.value();
+
+    auto id = registerPipeline(info, pipelineHash);
+    threadPool->submit([this, id, info]{
+        try{
+            buildPipeline(id, info);
+        }
+        catch(std::exception& e){
+            std::cout << "ERROR::CreatePipelineAsync => " << e.what() << std::endl;
+        }
+    });
+    return id;
+}
+
+PipelineID PipelineManager::CreateComputePipeline(const std::string& shaderPath)
+{
+    auto compileStart = std::chrono::steady_clock::now();
+    auto reflection = shaderRegistry->reflect(shaderPath);
+    if(reflection.stage != eStageCompute)
+        throw std::runtime_error(shaderPath + " is not a compute shader");
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for(auto& binding : reflection.bindings){
+        if(binding.set != 0)
+            continue;
+        bindings.push_back(vk::DescriptorSetLayoutBinding{
+            .binding = binding.binding,
+            .descriptorType = toDescriptorType(binding.type),
+            .descriptorCount = binding.count,
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        });
+    }
+    auto descriptorLayout = descriptorManager->CreateLayout(bindings);
+    std::vector<vk::PushConstantRange> pushConstantRanges;
+    for(auto& pushConstant : reflection.pushConstants)
+        pushConstantRanges.push_back(vk::PushConstantRange{
+            .stageFlags = vk::ShaderStageFlagBits::eCompute,
+            .offset = pushConstant.offset,
+            .size = pushConstant.size,
+        });
+    auto layout = getPipelineLayout({descriptorLayout}, pushConstantRanges);
+
+    auto computeShader = shaderRegistry->acquire(shaderPath);
+    vk::ComputePipelineCreateInfo pipelineCreateInfo{
+        .stage = vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = computeShader,
+            .pName = "main",
+        },
+        .layout = layout,
+    };
+    auto pipeline = device.createComputePipeline(pipelineCache, pipelineCreateInfo);
+    if(pipeline.result != vk::Result::eSuccess){
+        shaderRegistry->release(computeShader);
+        throw std::runtime_error("Couldn't create the compute pipeline for " + shaderPath);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.compileMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
+    stats.pipelinesCreated++;
+    auto pipelineId = nextPipelineId++;
+    pipelines[pipelineId] = Pipeline{
+        .pipeline = pipeline.value,
+        .pipelineLayout = layout,
+        .descriptorLayout = descriptorLayout,
+        .ready = true,
+        .computeShader = computeShader,
+    };
+    if(!pushConstantRanges.empty())
+        pipelines[pipelineId].pushConstants = pushConstantRanges[0];
+    return pipelineId;
+}
+
+bool PipelineManager::isPipelineReady(PipelineID id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pipelines[id].ready;
+}
+
+void PipelineManager::buildPipeline(PipelineID id, PipelineInfo info)
+{
+    auto pipeline = compilePipeline(info, getPipeline(id));
+    if(!pipeline.has_value())
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    pipelines[id] = pipeline.value();
+}
+
+//Runs on any thread, device object creation and the pipeline cache are thread safe
+std::optional<Pipeline> PipelineManager::compilePipeline(PipelineInfo& info, Pipeline base)
+{
+    auto compileStart = std::chrono::steady_clock::now();
+    auto fragmentShader = shaderRegistry->acquire(info.fragmentShaderPath);
+    auto vertexShader = shaderRegistry->acquire(info.vertexShaderPath);
+
+    //Both stages get every constant, ids a stage doesn't declare are ignored by the driver
+    std::vector<vk::SpecializationMapEntry> specializationEntries;
+    std::vector<uint32_t> specializationData;
+    for(auto& [constant, value] : info.pipelineCreateInfo.specializationConstants){
+        specializationEntries.push_back(vk::SpecializationMapEntry{
+            .constantID = static_cast<uint32_t>(constant),
+            .offset = static_cast<uint32_t>(specializationData.size() * sizeof(uint32_t)),
+            .size = sizeof(uint32_t),
+        });
+        specializationData.push_back(value);
+    }
+    vk::SpecializationInfo specializationInfo{
+        .mapEntryCount = static_cast<uint32_t>(specializationEntries.size()),
+        .pMapEntries = specializationEntries.data(),
+        .dataSize = specializationData.size() * sizeof(uint32_t),
+        .pData = specializationData.data(),
+    };
 
     vk::PipelineShaderStageCreateInfo fragmentShaderStage{
         .stage = vk::ShaderStageFlagBits::eFragment,
         .module = fragmentShader,
         .pName = "main",
+        .pSpecializationInfo = specializationEntries.empty() ? nullptr : &specializationInfo,
     };
 
     vk::PipelineShaderStageCreateInfo vertexShaderStage{
         .stage = vk::ShaderStageFlagBits::eVertex,
         .module = vertexShader,
         .pName = "main",
+        .pSpecializationInfo = specializationEntries.empty() ? nullptr : &specializationInfo,
     };
 
     std::vector<vk::PipelineShaderStageCreateInfo> stages = {fragmentShaderStage, vertexShaderStage};
@@ -793,29 +2359,7 @@ PipelineID PipelineManager::CreatePipeline(PipelineInfo info)
         .pAttachments = &colorBlendAttachmentState,
     };
 
-    vk::PipelineLayout layout;
-
-    if(info.layoutIds.has_value())
-    {
-        auto layouts = descriptorManager->getDSLayouts(info.layoutIds.value());
-        vk::PipelineLayoutCreateInfo layoutCreateInfo{
-            .setLayoutCount = static_cast<uint32_t>(layouts.size()),
-            .pSetLayouts = layouts.data(),
-            .pushConstantRangeCount = 0,
-            .pPushConstantRanges = nullptr,
-        };
-        layout = device.createPipelineLayout(layoutCreateInfo);
-    }
-    else
-    {
-        vk::PipelineLayoutCreateInfo layoutCreateInfo{
-            .setLayoutCount = 0,
-            .pSetLayouts = nullptr,
-            .pushConstantRangeCount = 0,
-            .pPushConstantRanges = nullptr,
-        };
-        layout = device.createPipelineLayout(layoutCreateInfo);
-    }
+    vk::PipelineLayout layout = base.pipelineLayout;
 
     vk::GraphicsPipelineCreateInfo pipelineCreateInfo{
         .stageCount = static_cast<uint32_t>(stages.size()),
@@ -835,49 +2379,179 @@ PipelineID PipelineManager::CreatePipeline(PipelineInfo info)
         .basePipelineIndex = -1,
     };
 
-    static PipelineID pipelineId = 0;
-    auto pipeline = device.createGraphicsPipeline(nullptr, pipelineCreateInfo);
-    if(pipeline.result != vk::Result::eSuccess)
+    auto pipeline = device.createGraphicsPipeline(pipelineCache, pipelineCreateInfo);
+    if(pipeline.result != vk::Result::eSuccess){
         std::cout << "Error pipeline" << std::endl;;
+        shaderRegistry->release(vertexShader);
+        shaderRegistry->release(fragmentShader);
+        return std::nullopt;
+    }
 
-    pipelines[pipelineId] = Pipeline{
-	.pipeline = pipeline.value,
-	.pipelineLayout = layout,
-	.sampler = info.sampler,
-        .descriptorLayout = info.layoutIds.value()[0],
-    };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.compileMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
+        stats.pipelinesCreated++;
+    }
+    base.pipeline = pipeline.value;
+    base.ready = true;
+    base.vertexShader = vertexShader;
+    base.fragmentShader = fragmentShader;
+    return base;
+}
+
+void PipelineManager::watchShader(const std::string& path, PipelineID id)
+{
+    if(inotifyFd < 0)
+        return;
+    pipelinesByShader[path].insert(id);
 
-    return pipelineId++;
+    auto slash = path.find_last_of('/');
+    auto directory = slash == std::string::npos ? std::string() : path.substr(0, slash);
+    if(watchesByDirectory.count(directory))
+        return;
+    //the directory is watched, compilers and editors often replace the file instead of writing it
+    int watch = inotify_add_watch(inotifyFd, directory.empty() ? "." : directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if(watch < 0){
+        std::cout << "[📃] PipelineManager: can't watch " << directory << ", hot reload disabled for it" << std::endl;
+        return;
+    }
+    watchesByDirectory[directory] = watch;
+    watchedDirectories[watch] = directory;
 }
 
-Pipeline PipelineManager::getPipeline(PipelineID id)
+void PipelineManager::pollShaderChanges()
 {
-    return pipelines[id];
+    if(inotifyFd < 0)
+        return;
+
+    std::set<PipelineID> changed;
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while((length = read(inotifyFd, buffer, sizeof(buffer))) > 0){
+        for(char* it = buffer; it < buffer + length;){
+            auto event = reinterpret_cast<inotify_event*>(it);
+            it += sizeof(inotify_event) + event->len;
+            if(event->len == 0)
+                continue;
+            auto& directory = watchedDirectories[event->wd];
+            auto path = directory.empty() ? std::string(event->name) : directory + "/" + event->name;
+            auto pipelinesIt = pipelinesByShader.find(path);
+            if(pipelinesIt != pipelinesByShader.end())
+                changed.insert(pipelinesIt->second.begin(), pipelinesIt->second.end());
+        }
+    }
+
+    for(auto id : changed){
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            //Pipelines still on their first compile already read the new file
+            if(!pipelines[id].ready)
+                continue;
+            generation = ++rebuildGenerations[id];
+        }
+        std::cout << "[📃] PipelineManager: reloading pipeline " << id << std::endl;
+        threadPool->submit([this, id, generation]{
+            try{
+                rebuildPipeline(id, generation);
+            }
+            catch(std::exception& e){
+                std::cout << "ERROR::rebuildPipeline => " << e.what() << std::endl;
+            }
+        });
+    }
 }
 
-std::vector<char> PipelineManager::readFile(const std::string &filename)
+//The new pipeline is only swapped in by beginFrame, the current one keeps being used until then
+void PipelineManager::rebuildPipeline(PipelineID id, uint64_t generation)
 {
-    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+    PipelineInfo info;
+    Pipeline current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!pipelineInfos.count(id))
+            return;
+        info = pipelineInfos[id];
+        current = pipelines[id];
+    }
+    //XXX: the layout is kept, changing the bindings of a shader still needs a restart
+    auto rebuilt = compilePipeline(info, current);
+    if(!rebuilt.has_value())
+        return;
 
-    if (!file.is_open()) {
-        throw std::runtime_error("Erro ao ler arquivo");
+    std::lock_guard<std::mutex> lock(mutex);
+    pendingSwaps.push_back(PendingSwap{
+        .id = id,
+        .generation = generation,
+        .pipeline = rebuilt.value(),
+    });
+}
+
+void PipelineManager::beginFrame(uint64_t frameNumber)
+{
+    pollShaderChanges();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for(auto& swap : pendingSwaps){
+        auto it = pipelines.find(swap.id);
+        //a newer rebuild was started or the pipeline was destroyed, this one was never used
+        if(it == pipelines.end() || rebuildGenerations[swap.id] != swap.generation){
+            retiringPipelines.push_back(RetiringPipeline{.pipeline = swap.pipeline, .frameNumber = frameNumber});
+            continue;
+        }
+        retiringPipelines.push_back(RetiringPipeline{.pipeline = it->second, .frameNumber = frameNumber});
+        it->second = swap.pipeline;
+        stats.pipelinesReloaded++;
     }
-    size_t fileSize = (size_t) file.tellg();
-    std::vector<char> buffer(fileSize);
-    file.seekg(0);
-    file.read(buffer.data(), fileSize);
-    file.close();
+    pendingSwaps.clear();
+
+    //Frames recorded with the old pipelines must have retired, no waitIdle needed
+    while(!retiringPipelines.empty() && retiringPipelines.front().frameNumber + framesInFlight <= frameNumber){
+        auto& retired = retiringPipelines.front().pipeline;
+        device.destroyPipeline(retired.pipeline);
+        shaderRegistry->release(retired.vertexShader);
+        shaderRegistry->release(retired.fragmentShader);
+        retiringPipelines.pop_front();
+    }
+}
 
-    return buffer;    
+void PipelineManager::destroyPipeline(PipelineID id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pipelines.find(id);
+    if(it == pipelines.end())
+        return;
+
+    device.destroyPipeline(it->second.pipeline);
+    shaderRegistry->release(it->second.vertexShader);
+    shaderRegistry->release(it->second.fragmentShader);
+    shaderRegistry->release(it->second.computeShader);
+    //the layout is shared and stays in pipelineLayouts
+    for(auto hashIt = pipelinesByHash.begin(); hashIt != pipelinesByHash.end(); hashIt++)
+        if(hashIt->second == id){
+            pipelinesByHash.erase(hashIt);
+            break;
+        }
+    for(auto& [path, ids] : pipelinesByShader)
+        ids.erase(id);
+    pipelineInfos.erase(id);
+    pipelines.erase(it);
 }
 
-vk::ShaderModule PipelineManager::compileShaderModule(const std::vector<char> &code)
+ShaderReflection PipelineManager::reflectShader(const std::string& path)
 {
-    vk::ShaderModuleCreateInfo createInfo{
-        .codeSize = static_cast<uint32_t>(code.size()),
-        .pCode = reinterpret_cast<const uint32_t*>(code.data()),
-    };
-    return device.createShaderModule(createInfo);
+    return shaderRegistry->reflect(path);
+}
+
+ShaderStats PipelineManager::getShaderStats()
+{
+    return shaderRegistry->getStats();
+}
+
+Pipeline PipelineManager::getPipeline(PipelineID id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pipelines[id];
 }
 
 
@@ -952,30 +2626,39 @@ static void check_vk_result(VkResult err)
         abort();
 }
 
-//FIXME: Hardcoded frames in flight
-BufferId frameUniformBuffers[2];
-
-struct LightUniform {
-    glm::vec4 lightPosition;
-    glm::vec4 lightColor;
-};
-
-struct FrameUniform {
-    glm::vec4 cameraPosition;
-    glm::mat4 cameraProjection;
-    glm::mat4 cameraView;
-    glm::vec4 globalLightPosition;
-    LightUniform lights[10];
-    uint lightsCount;
-};
-
-struct ObjectUniform {
-    glm::mat4 model;
-};
-
+//FIXME: Hardcoded frames in flight
+TypedBuffer<FrameUniform> frameUniformBuffers[2];
+const size_t maxInstancesPerFrame = 16384;
+//Every level of a mesh has its own instance range in the GPU driven path
+const size_t maxInstanceSlots = 4 * maxInstancesPerFrame;
+TypedBuffer<InstanceData> instanceBuffers[2];
+const size_t maxIndirectCommands = 16384;
+const size_t maxIndirectBatches = 1024;
+//Starting size of the shared geometry buffers, they grow when full
+const uint64_t geometryPoolVertices = 256 * 1024;
+const uint64_t geometryPoolIndices = 1024 * 1024;
+TypedBuffer<vk::DrawIndexedIndirectCommand> indirectBuffers[2];
+TypedBuffer<uint32_t> drawCountBuffers[2];
+//GPU culling inputs, written with the rest of the indirect scene
+TypedBuffer<CullObject> cullObjectBuffers[2];
+TypedBuffer<CullCommand> cullCommandBuffers[2];
+TypedBuffer<InstanceData> sceneInstanceBuffers[2];
+TypedBuffer<CullStats> cullStatsBuffers[2];
+TypedBuffer<CullUniform> cullUniformBuffers[2];
+TypedBuffer<uint32_t> cullOccludedBuffers[2]; //objects the early phase rejected for occlusion
+TypedBuffer<uint32_t> cullLodBuffers[2]; //level each object drew last, for the hysteresis
+const uint32_t cullGroupSize = 64; //local_size_x of cull.comp
+const std::string cullShaderPath = MYEN_SHADER_DIR "/default-shaders/cull";
+const uint32_t pyramidGroupSize = 8; //local_size_x and y of hiz.comp
+const std::string pyramidShaderPath = MYEN_SHADER_DIR "/default-shaders/hiz";
+const uint32_t occlusionBufferWidth = 256; //height follows the aspect of the surface
+
+
+const std::string pipelineCachePath = "myen_pipeline_cache.bin";
 
 RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : window(window), camera(camera)
 {
+    auto startupBegin = std::chrono::steady_clock::now();
     //======== Vulkan Initialization ========
     //Vulkan Init
     vk::ApplicationInfo applicationInfo {
@@ -1063,8 +2746,20 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
     };
 
     std::vector<const char *> deviceExtensions{VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    //Optional features only get enabled when the device has them, software implementations often don't
+    auto supportedFeatures = physicalDevice.getFeatures();
+    gpuFeatures = GpuFeatures{
+        .multiDrawIndirect = static_cast<bool>(supportedFeatures.multiDrawIndirect),
+        .drawIndirectFirstInstance = static_cast<bool>(supportedFeatures.drawIndirectFirstInstance),
+        .drawIndirectCount = hasDeviceExtension(physicalDevice, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME),
+        .samplerAnisotropy = static_cast<bool>(supportedFeatures.samplerAnisotropy),
+    };
+    if(gpuFeatures.drawIndirectCount)
+        deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
     vk::PhysicalDeviceFeatures physicalDeviceFeatures{
-    .samplerAnisotropy = true,
+    .multiDrawIndirect = gpuFeatures.multiDrawIndirect,
+    .drawIndirectFirstInstance = gpuFeatures.drawIndirectFirstInstance,
+    .samplerAnisotropy = gpuFeatures.samplerAnisotropy,
     };
     vk::DeviceCreateInfo deviceCreateInfo{
     .queueCreateInfoCount    = static_cast<uint32_t>(queueCreateInfos.size()),
@@ -1076,6 +2771,14 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
     .pEnabledFeatures        = &physicalDeviceFeatures,
     };
     device = physicalDevice.createDevice(deviceCreateInfo);
+    if(gpuFeatures.drawIndirectCount)
+        drawIndexedIndirectCount = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(
+            device.getProcAddr("vkCmdDrawIndexedIndirectCountKHR"));
+    //Without firstInstance the commands can't point into the shared instance buffer
+    gpuDriven = gpuFeatures.drawIndirectFirstInstance;
+    std::cout << "[📃] RenderBackend: multiDrawIndirect " << gpuFeatures.multiDrawIndirect
+              << ", drawIndirectFirstInstance " << gpuFeatures.drawIndirectFirstInstance
+              << ", drawIndirectCount " << gpuFeatures.drawIndirectCount << std::endl;
 
     graphicsQueue = device.getQueue(graphicsFamilyId.value(), 0);
     presentQueue  = device.getQueue(presentFamilyId.value(), 0);
@@ -1209,8 +2912,47 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
         .pDependencies = &subpassDependency,
     };
     renderPass = device.createRenderPass(renderpassCreateInfo);
-    auto depthImageId = resourceManager->createImage(surfaceSize, ImageType::eDepth);
-    auto depthImageView = resourceManager->getImageView(depthImageId);
+
+    //Occlusion culling splits the frame in two, both are compatible with renderPass so
+    //they use the same framebuffers and pipelines. The early one leaves the depth ready
+    //to be read by the pyramid build, the late one loads what the early one drew.
+    std::array<vk::AttachmentDescription, 2> earlyAttachments = attachments;
+    earlyAttachments[0].finalLayout = vk::ImageLayout::eColorAttachmentOptimal;
+    earlyAttachments[1].finalLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    std::array<vk::SubpassDependency, 2> earlyDependencies = {subpassDependency, vk::SubpassDependency{
+        .srcSubpass = 0,
+        .dstSubpass = VK_SUBPASS_EXTERNAL,
+        .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eLateFragmentTests,
+        .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eComputeShader,
+        .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        .dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eShaderRead,
+    }};
+    renderpassCreateInfo.pAttachments = earlyAttachments.data();
+    renderpassCreateInfo.dependencyCount = static_cast<uint32_t>(earlyDependencies.size());
+    renderpassCreateInfo.pDependencies = earlyDependencies.data();
+    earlyRenderPass = device.createRenderPass(renderpassCreateInfo);
+
+    std::array<vk::AttachmentDescription, 2> lateAttachments = attachments;
+    lateAttachments[0].loadOp = vk::AttachmentLoadOp::eLoad;
+    lateAttachments[0].initialLayout = vk::ImageLayout::eColorAttachmentOptimal;
+    lateAttachments[1].loadOp = vk::AttachmentLoadOp::eLoad;
+    lateAttachments[1].initialLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    vk::SubpassDependency lateDependency{
+        .srcSubpass = VK_SUBPASS_EXTERNAL,
+        .dstSubpass = 0,
+        .srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eComputeShader,
+        .dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests,
+        .srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite,
+        .dstAccessMask = vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite
+            | vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+    };
+    renderpassCreateInfo.pAttachments = lateAttachments.data();
+    renderpassCreateInfo.dependencyCount = 1;
+    renderpassCreateInfo.pDependencies = &lateDependency;
+    lateRenderPass = device.createRenderPass(renderpassCreateInfo);
+
+    depthImage = resourceManager->createImage(surfaceSize, ImageType::eDepth);
+    auto depthImageView = resourceManager->getImageView(depthImage);
     framebuffers.reserve(swapChainImageViews.size());
     for (size_t i = 0; i < swapChainImageViews.size(); i++) {
         std::array<vk::ImageView, 2> attachments = {
@@ -1241,8 +2983,10 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
     renderFinishedSemaphores.push_back(device.createSemaphore(semaphoreCreateInfo));
     }
 
-    descriptorManager = new DescriptorManager(device);
-    pipelineManager = new PipelineManager(device, descriptorManager);
+    descriptorManager = new DescriptorManager(device, numberFramesInFlight);
+    threadPool = new common::ThreadPool();
+    pipelineManager = new PipelineManager(device, descriptorManager, threadPool, numberFramesInFlight);
+    pipelineManager->loadPipelineCache(pipelineCachePath, physicalDevice.getProperties());
     //####### Vulkan Initialization #######
 
     //ImGui
@@ -1257,7 +3001,7 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
         .Device = device,
         .QueueFamily = graphicsFamilyId.value(), 
         .Queue = graphicsQueue,
-        .PipelineCache = NULL,
+        .PipelineCache = pipelineManager->getPipelineCache(),
         .DescriptorPool = descriptorManager->getDescriptorPool(),
         .Subpass = 0,
         .MinImageCount = 2,
@@ -1272,8 +3016,30 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
     commands->EndSingleTimeCommand(commandBuffer, true);
     ImGui_ImplVulkan_DestroyFontUploadObjects();
 
-    frameUniformBuffers[0] = resourceManager->createBuffer(BufferType::eUniformBuffer, sizeof(FrameUniform));
-    frameUniformBuffers[1] = resourceManager->createBuffer(BufferType::eUniformBuffer, sizeof(FrameUniform));
+    frameUniformBuffers[0] = resourceManager->createTypedBuffer<FrameUniform>(BufferType::eUniformBuffer);
+    frameUniformBuffers[1] = resourceManager->createTypedBuffer<FrameUniform>(BufferType::eUniformBuffer);
+    instanceBuffers[0] = resourceManager->createTypedBuffer<InstanceData>(BufferType::eStorageBuffer, maxInstanceSlots);
+    instanceBuffers[1] = resourceManager->createTypedBuffer<InstanceData>(BufferType::eStorageBuffer, maxInstanceSlots);
+    for(int frame = 0; frame < numberFramesInFlight; frame++){
+        indirectBuffers[frame] = resourceManager->createTypedBuffer<vk::DrawIndexedIndirectCommand>(BufferType::eIndirectBuffer, maxIndirectCommands);
+        drawCountBuffers[frame] = resourceManager->createTypedBuffer<uint32_t>(BufferType::eIndirectBuffer, maxIndirectBatches);
+        cullObjectBuffers[frame] = resourceManager->createTypedBuffer<CullObject>(BufferType::eStorageBuffer, maxInstancesPerFrame);
+        cullCommandBuffers[frame] = resourceManager->createTypedBuffer<CullCommand>(BufferType::eStorageBuffer, maxIndirectCommands);
+        sceneInstanceBuffers[frame] = resourceManager->createTypedBuffer<InstanceData>(BufferType::eStorageBuffer, maxInstancesPerFrame);
+        cullStatsBuffers[frame] = resourceManager->createTypedBuffer<CullStats>(BufferType::eStorageBuffer);
+        cullUniformBuffers[frame] = resourceManager->createTypedBuffer<CullUniform>(BufferType::eUniformBuffer);
+        cullOccludedBuffers[frame] = resourceManager->createTypedBuffer<uint32_t>(BufferType::eStorageBuffer, maxInstancesPerFrame);
+        cullLodBuffers[frame] = resourceManager->createTypedBuffer<uint32_t>(BufferType::eStorageBuffer, maxInstancesPerFrame);
+    }
+    createDepthPyramid();
+    createCullPass();
+    uniformRing = new UniformRing(resourceManager,
+                                  uniformRingFrameSize,
+                                  physicalDevice.getProperties().limits.minUniformBufferOffsetAlignment,
+                                  numberFramesInFlight);
+    geometryPool = new GeometryPool(resourceManager, geometryPoolVertices, geometryPoolIndices, numberFramesInFlight);
+    occlusionBuffer = new OcclusionBuffer(occlusionBufferWidth,
+                                          std::max(occlusionBufferWidth * surfaceSize.height / surfaceSize.width, 1u));
 
     //Hardcoded testing
     std::vector<common::Vertex> vertex_points{
@@ -1321,62 +3087,85 @@ RenderBackend::RenderBackend(common::Window* window, common::Camera* camera) : w
     //auto modelId_hardcoded = addModel(meshId, glm::vec3(0.0f), glm::vec3(0.0f), &texture);
     //createPipeline(common::PipelineCreateInfo{});
     createSampler();
+
+    auto pipelineStats = pipelineManager->getStats();
+    auto startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupBegin).count();
+    std::cout << "[📃] RenderBackend: started in " << startupMs << " ms, pipeline cache "
+              << (pipelineStats.cacheWarm ? "warm (" : "cold (") << pipelineStats.cacheBytesLoaded << " bytes)" << std::endl;
 }
 
 
 RenderBackend::~RenderBackend()
 {
+    //Finishes the pipelines that are still compiling
+    delete threadPool;
+    pipelineManager->savePipelineCache();
     instance.destroy();
 }
 
 
 ImageId RenderBackend::addTexture(common::Texture* texture)
 {
-    auto textureStageBuffer = resourceManager->createBuffer(BufferType::eStageBuffer, texture->data_size);
-    resourceManager->insertDataBuffer(textureStageBuffer, texture->data_size, texture->data);
-
     auto extent = vk::Extent2D{
         .width = static_cast<uint32_t>(texture->width),
         .height = static_cast<uint32_t>(texture->height)
     };
     auto image = resourceManager->createImage(extent, ImageType::eTexture);
-    resourceManager->copyBufferToImage(textureStageBuffer, image, extent);
+    auto uploadTicket = resourceManager->uploadImage(image, extent, texture->data_size, texture->data);
     auto imageView = resourceManager->getImageView(image);
     static ImageId imageId = 0;
     this->textures[imageId] = Texture{
             .image = image,
             .imageView = imageView,
+            .uploadTicket = uploadTicket,
     };
 
     return imageId;
 }
 
 
-MeshId RenderBackend::addMesh(common::Mesh *common_mesh)
+MeshId RenderBackend::addMesh(common::Mesh *common_mesh, bool occluder)
 {
-    auto vertexBufferSize = sizeof(common::Vertex) * common_mesh->vertices.size();
-    auto stageBuffer = resourceManager->createBuffer(BufferType::eStageBuffer, vertexBufferSize);
-    resourceManager->insertDataBuffer(stageBuffer, vertexBufferSize, common_mesh->vertices.data());
-    auto vertexBuffer = resourceManager->createBuffer(BufferType::eVertexBuffer, vertexBufferSize);
-    resourceManager->copyBuffers(stageBuffer, vertexBuffer, vertexBufferSize);
-
-    auto indexBufferSize = sizeof(uint32_t) * common_mesh->indices.size();
-    auto indexBuffer = resourceManager->createBuffer(BufferType::eIndexBuffer, indexBufferSize);
-    resourceManager->insertDataBuffer(stageBuffer, indexBufferSize, common_mesh->indices.data());
-    resourceManager->copyBuffers(stageBuffer, indexBuffer, indexBufferSize);
-
+    UploadTicket uploadTicket;
+    auto geometry = geometryPool->add(common_mesh, uploadTicket);
+    auto range = geometryPool->getRange(geometry);
+
+    auto lods = common_mesh->lods;
+    if(lods.empty())
+        lods.push_back(common::MeshLod{
+            .firstIndex = 0,
+            .indexCount = static_cast<uint32_t>(common_mesh->indices.size()),
+            .error = 0.0f,
+        });
     Mesh mesh{
-        .vertexBufferId = vertexBuffer,
-        .indexBufferId = indexBuffer,
+        .geometry = geometry,
+        .vertexOffset = static_cast<int32_t>(range.vertexOffset),
+        .firstIndex = range.firstIndex,
         .vertexCount = common_mesh->vertices.size(),
-        .indexCount = common_mesh->indices.size(),
+        .indexCount = lods[0].indexCount,
+        .bounds = computeBounds(common_mesh->vertices),
+        .lods = lods,
+        .uploadTicket = uploadTicket,
     };
 
     static MeshId id = 0;
     meshes[id] = mesh;
+    if(occluder)
+        occluderMeshes[id] = makeOccluderMesh(*common_mesh);
     return id++;
 }
 
+void RenderBackend::removeMesh(MeshId meshId)
+{
+    auto meshIt = meshes.find(meshId);
+    if(meshIt == meshes.end())
+        return;
+    geometryPool->remove(meshIt->second.geometry);
+    meshes.erase(meshIt);
+    occluderMeshes.erase(meshId);
+    markSceneDirty();
+}
+
 LightId RenderBackend::addLight(glm::vec3 position, glm::vec3 color)
 {
     printf("Light(%f, %f, %f)\n", position.x, position.y, position.z);
@@ -1398,7 +3187,7 @@ void RenderBackend::createSampler() {
         .addressModeV = vk::SamplerAddressMode::eRepeat,
         .addressModeW = vk::SamplerAddressMode::eRepeat,
         .mipLodBias = 0.0f,
-        .anisotropyEnable = true,
+        .anisotropyEnable = gpuFeatures.samplerAnisotropy,
         .maxAnisotropy = 4,
         .compareEnable = false,
         .compareOp = vk::CompareOp::eAlways,
@@ -1410,61 +3199,137 @@ void RenderBackend::createSampler() {
     sampler = device.createSampler(samplerInfo);
 }
 
+//Bindings the backend knows how to fill, each shader declares only the ones it uses
+const uint32_t frameUniformBinding = 0;
+const uint32_t objectUniformBinding = 1;
+const uint32_t textureBinding = 2;
+const uint32_t instanceBinding = 3;
+//Offsets inside common::Vertex for each vertex shader input location
+const std::vector<uint32_t> vertexAttributeOffsets = {
+    offsetof(common::Vertex, pos),
+    offsetof(common::Vertex, normal),
+    offsetof(common::Vertex, texCoord),
+};
+
+vk::Format toVertexFormat(const ReflectedVertexInput& input)
+{
+    const vk::Format floatFormats[] = {vk::Format::eR32Sfloat, vk::Format::eR32G32Sfloat,
+                                       vk::Format::eR32G32B32Sfloat, vk::Format::eR32G32B32A32Sfloat};
+    const vk::Format intFormats[] = {vk::Format::eR32Sint, vk::Format::eR32G32Sint,
+                                     vk::Format::eR32G32B32Sint, vk::Format::eR32G32B32A32Sint};
+    const vk::Format uintFormats[] = {vk::Format::eR32Uint, vk::Format::eR32G32Uint,
+                                      vk::Format::eR32G32B32Uint, vk::Format::eR32G32B32A32Uint};
+    auto components = std::clamp(input.components, 1u, 4u) - 1;
+    switch(input.baseType){
+    case ReflectedBaseType::eInt: return intFormats[components];
+    case ReflectedBaseType::eUint: return uintFormats[components];
+    default: return floatFormats[components];
+    }
+}
+
 PipelineID RenderBackend::createPipeline(common::PipelineCreateInfo createInfo)
 {
-    auto layout = descriptorManager->CreateLayout({
-        vk::DescriptorSetLayoutBinding {
+    auto lightCount = createInfo.specializationConstants.find(common::ShaderConstant::LightCount);
+    if(lightCount != createInfo.specializationConstants.end() && lightCount->second > maxLights){
+        std::cout << "[📃] RenderBackend: light count " << lightCount->second << " clamped to " << maxLights << std::endl;
+        lightCount->second = maxLights;
+    }
+
+    std::vector<ShaderReflection> stages{
+        pipelineManager->reflectShader(createInfo.vertexShaderPath),
+        pipelineManager->reflectShader(createInfo.fragmentShaderPath),
+    };
+
+    //The layout is the union of what both stages use
+    std::map<uint32_t, vk::DescriptorSetLayoutBinding> bindings;
+    std::optional<vk::PushConstantRange> pushConstantRange;
+    for(auto& stage : stages){
+        auto stageFlags = vk::ShaderStageFlags(stage.stage);
+        for(auto& reflected : stage.bindings){
+            if(reflected.set != 0){
+                std::cout << "ERROR::createPipeline => only set 0 is supported, "
+                          << reflected.name << " is in set " << reflected.set << std::endl;
+                exit(0);
+            }
+            auto it = bindings.find(reflected.binding);
+            if(it != bindings.end()){
+                it->second.stageFlags |= stageFlags;
+                continue;
+            }
+            auto type = toDescriptorType(reflected.type);
+            if(reflected.binding == objectUniformBinding && type == vk::DescriptorType::eUniformBuffer)
+                type = vk::DescriptorType::eUniformBufferDynamic;
+            bindings[reflected.binding] = vk::DescriptorSetLayoutBinding{
+                .binding = reflected.binding,
+                .descriptorType = type,
+                .descriptorCount = reflected.count,
+                .stageFlags = stageFlags,
+                .pImmutableSamplers = type == vk::DescriptorType::eCombinedImageSampler ? &sampler : nullptr,
+            };
+        }
+        for(auto& reflected : stage.pushConstants){
+            if(!pushConstantRange.has_value()){
+                pushConstantRange = vk::PushConstantRange{
+                    .stageFlags = stageFlags,
+                    .offset = reflected.offset,
+                    .size = reflected.size,
+                };
+                continue;
+            }
+            auto& range = pushConstantRange.value();
+            auto end = std::max(range.offset + range.size, reflected.offset + reflected.size);
+            range.offset = std::min(range.offset, reflected.offset);
+            range.size = end - range.offset;
+            range.stageFlags |= stageFlags;
+        }
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> layoutBindings;
+    for(auto& [binding, layoutBinding] : bindings)
+        layoutBindings.push_back(layoutBinding);
+    auto layout = descriptorManager->CreateLayout(layoutBindings);
+
+    //Only the attributes the vertex shader reads are fetched
+    std::vector<vk::VertexInputAttributeDescription> vertexAttribs;
+    for(auto& input : stages[0].vertexInputs){
+        if(input.location >= vertexAttributeOffsets.size()){
+            std::cout << "ERROR::createPipeline => vertex input " << input.name
+                      << " uses location " << input.location << " that common::Vertex doesn't have" << std::endl;
+            exit(0);
+        }
+        vertexAttribs.push_back(vk::VertexInputAttributeDescription{
+            .location = input.location,
             .binding = 0,
-            .descriptorType = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
-            .stageFlags = vk::ShaderStageFlagBits::eAll,
-        },
-        vk::DescriptorSetLayoutBinding {
-            .binding = 1,
-            .descriptorType = vk::DescriptorType::eUniformBuffer,
-            .descriptorCount = 1,
-            .stageFlags = vk::ShaderStageFlagBits::eAll,
-        },
-        vk::DescriptorSetLayoutBinding {
-            .binding = 2,
-            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-            .descriptorCount = 1,
-            .stageFlags = vk::ShaderStageFlagBits::eAll,
-            .pImmutableSamplers = &sampler,
+            .format = toVertexFormat(input),
+            .offset = vertexAttributeOffsets[input.location],
+        });
+    }
+    std::vector<vk::VertexInputBindingDescription> vertexBinds;
+    if(!vertexAttribs.empty()){
+        vertexBinds.push_back(vk::VertexInputBindingDescription{
+            .binding = 0,
+            .stride = static_cast<uint32_t>(sizeof(common::Vertex)),
+            .inputRate = vk::VertexInputRate::eVertex,
+        });
+    }
+    std::vector<vk::PushConstantRange> pushConstantRanges;
+    if(pushConstantRange.has_value()){
+        auto& range = pushConstantRange.value();
+        if(range.offset + range.size > sizeof(ObjectConstants)){
+            std::cout << "ERROR::createPipeline => push constant block of " << range.offset + range.size
+                      << " bytes, only ObjectConstants (" << sizeof(ObjectConstants) << " bytes) is pushed" << std::endl;
+            exit(0);
         }
-    });
+        pushConstantRanges.push_back(range);
+    }
 
-    auto pipelineid = pipelineManager->CreatePipeline({
+    auto pipelineid = pipelineManager->CreatePipelineAsync({
         .pipelineCreateInfo = createInfo,
         .vertexShaderPath   = createInfo.vertexShaderPath,
         .fragmentShaderPath = createInfo.fragmentShaderPath,
-        .vertexBinds = std::vector<vk::VertexInputBindingDescription>{
-            vk::VertexInputBindingDescription{
-                .binding = 0,
-                .stride = static_cast<uint32_t>(sizeof(common::Vertex)),
-                .inputRate = vk::VertexInputRate::eVertex,
-            }
-        },
-        .vertexAttribs = std::vector<vk::VertexInputAttributeDescription>{
-            vk::VertexInputAttributeDescription{
-                .location = 0,
-                .binding = 0,
-                .format = vk::Format::eR32G32B32Sfloat,
-                .offset = 0,
-            },
-            vk::VertexInputAttributeDescription{
-                .location = 1,
-                .binding = 0,
-                .format = vk::Format::eR32G32B32Sfloat,
-                .offset = offsetof(common::Vertex, normal),
-            },
-            vk::VertexInputAttributeDescription{
-                .location = 2,
-                .binding = 0,
-                .format = vk::Format::eR32G32Sfloat,
-                .offset = offsetof(common::Vertex, texCoord),
-            }
-        },
+        .vertexBinds = vertexBinds,
+        .vertexAttribs = vertexAttribs,
+        .pushConstantRanges = pushConstantRanges,
         .depthStencilStateCreateInfo = vk::PipelineDepthStencilStateCreateInfo{
             .depthTestEnable = true,
             .depthWriteEnable = true,
@@ -1484,18 +3349,83 @@ PipelineID RenderBackend::createPipeline(common::PipelineCreateInfo createInfo)
     return pipelineid;
 }
 
+MaterialId RenderBackend::getMaterial(PipelineID pipelineId, ImageId texture)
+{
+    auto materialKey = std::make_pair(pipelineId, texture);
+    auto it = materialIds.find(materialKey);
+    if(it != materialIds.end())
+        return it->second;
+
+    auto pipeline = pipelineManager->getPipeline(pipelineId);
+    auto dsLayout = pipeline.descriptorLayout;
+
+    static MaterialId id = 0;
+    Material material{
+        .id = id,
+        .pipeline = pipelineId,
+        .textureId = texture,
+    };
+    //Nothing here changes from frame to frame, so the sets are written only once
+    auto bindings = descriptorManager->getLayoutBindings(dsLayout);
+    for(auto& binding : bindings){
+        if(binding.binding == objectUniformBinding)
+            material.objectUniform = true;
+        if(binding.binding == instanceBinding)
+            material.instanced = true;
+    }
+    for(int frame = 0; frame < numberFramesInFlight; frame++){
+        std::vector<WriteDescriptorInfo> writes;
+        for(auto& binding : bindings){
+            switch(binding.binding){
+            case frameUniformBinding:
+                writes.push_back(WriteDescriptorInfo{
+                    .bufferInfo = frameUniformBuffers[frame].getDescriptorInfo(),
+                });
+                break;
+            case objectUniformBinding:
+                writes.push_back(WriteDescriptorInfo{
+                    .bufferInfo = vk::DescriptorBufferInfo{
+                        .buffer = uniformRing->getBuffer(frame),
+                        .offset = 0,
+                        .range = sizeof(ObjectUniform),
+                    },
+                });
+                break;
+            case textureBinding:
+                writes.push_back(WriteDescriptorInfo{
+                    .imageInfo = vk::DescriptorImageInfo{
+                        .sampler = pipeline.sampler,
+                        .imageView = textures[texture].imageView,
+                        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+                    }
+                });
+                break;
+            case instanceBinding:
+                writes.push_back(WriteDescriptorInfo{
+                    .bufferInfo = vk::DescriptorBufferInfo{
+                        .buffer = instanceBuffers[frame].buffer,
+                        .offset = 0,
+                        .range = sizeof(InstanceData) * instanceBuffers[frame].count,
+                    },
+                });
+                break;
+            default:
+                std::cout << "ERROR::getMaterial => nothing to write on binding " << binding.binding << std::endl;
+                exit(0);
+            }
+        }
+        material.descriptors[frame] = descriptorManager->getFreeDS(dsLayout);
+        descriptorManager->updateDS(material.descriptors[frame], writes);
+    }
+    materials[id] = material;
+    materialIds[materialKey] = id;
+    return id++;
+}
+
 ModelId RenderBackend::addModel(MeshId mesh, glm::vec3 position,
                                 glm::vec3 rotation, ImageId texture,
 				PipelineID pipelineId)
 {
-    auto _texture = this->textures[texture];
-
-    auto dsLayout = pipelineManager->getPipeline(pipelineId).descriptorLayout;
-    descriptorManager->preAllocateDescriptorSets(dsLayout, 2);
-    DSId descriptors[2];
-    descriptors[0] = descriptorManager->getFreeDS(dsLayout);
-    descriptors[1] = descriptorManager->getFreeDS(dsLayout);
-
     static ModelId id = 0;
     Model model{
         .id = id,
@@ -1504,21 +3434,76 @@ ModelId RenderBackend::addModel(MeshId mesh, glm::vec3 position,
         .rotation = rotation,
 	.textureId = texture,
         .pipeline = pipelineId,
-        .descriptors = {
-            descriptors[0],
-            descriptors[1]
-        },
-        .uniformBuffers = {
-            resourceManager->createBuffer(BufferType::eUniformBuffer, sizeof(ObjectUniform)),
-            resourceManager->createBuffer(BufferType::eUniformBuffer, sizeof(ObjectUniform))
-        },
+        .material = getMaterial(pipelineId, texture),
     };
     models[id] = model;
+    if(!materials[model.material].instanced)
+        directModelIds.push_back(id);
+    markSceneDirty();
     return id++;
 }
 
 void RenderBackend::updateModelPosition(ModelId model, glm::vec3 position, glm::vec3 rotation) {
-    models[model].position = position;
+    auto& instance = models[model];
+    //Called for every entity every frame, the indirect scene is only rebuilt when one moved
+    if(instance.position == position)
+        return;
+    instance.position = position;
+    //The proxy was baked with the old position
+    if(instance.hlod.has_value())
+        removeHlod(instance.hlod.value());
+    markSceneDirty();
+}
+
+MaterialId RenderBackend::getModelMaterial(ModelId model)
+{
+    return models[model].material;
+}
+
+HlodId RenderBackend::addHlod(const std::vector<ModelId>& members, common::Mesh* proxy, glm::vec3 position, float distance)
+{
+    static HlodId id = 0;
+    auto& first = models[members[0]];
+    auto proxyId = addModel(addMesh(proxy), position, glm::vec3(0.0f), first.textureId, first.pipeline);
+    //Switching between members and proxy happens every frame, so all of them leave the indirect scene
+    std::vector<ModelId> clusterModels = members;
+    clusterModels.push_back(proxyId);
+    for(auto modelId : clusterModels){
+        auto& model = models[modelId];
+        model.hlod = id;
+        model.hlodProxy = modelId == proxyId;
+        if(materials[model.material].instanced)
+            directModelIds.push_back(modelId);
+    }
+    hlods[id] = Hlod{
+        .proxy = proxyId,
+        .members = members,
+        .distance = distance,
+        .proxyActive = false,
+    };
+    markSceneDirty();
+    return id++;
+}
+
+void RenderBackend::removeHlod(HlodId id)
+{
+    auto it = hlods.find(id);
+    if(it == hlods.end())
+        return;
+    auto& hlod = it->second;
+    //Instanced members go back to the indirect scene
+    for(auto modelId : hlod.members){
+        auto& model = models[modelId];
+        model.hlod.reset();
+        if(materials[model.material].instanced)
+            directModelIds.erase(std::remove(directModelIds.begin(), directModelIds.end(), modelId), directModelIds.end());
+    }
+    directModelIds.erase(std::remove(directModelIds.begin(), directModelIds.end(), hlod.proxy), directModelIds.end());
+    auto proxyMesh = models[hlod.proxy].meshId;
+    models.erase(hlod.proxy);
+    removeMesh(proxyMesh);
+    hlods.erase(it);
+    markSceneDirty();
 }
 
 
@@ -1531,6 +3516,750 @@ void RenderBackend::addUICommands(std::string windowName, std::function<void(voi
 }
 
 
+//Front to back inside the same pipeline, material and mesh. Ids past the bit
+//budget only alias in the key and lose sorting, the recorder compares real handles.
+uint64_t makeSortKey(PipelineID pipeline, MaterialId material, MeshId mesh, float depth)
+{
+    uint32_t depthBits;
+    std::memcpy(&depthBits, &depth, sizeof(depthBits));
+    //positive floats sort like their bits, drop the sign and keep the top 20
+    uint64_t quantizedDepth = (depthBits >> 11) & 0xfffff;
+    return (uint64_t)(pipeline & 0xfff) << 52 |
+           (uint64_t)(material & 0xffff) << 36 |
+           (uint64_t)(mesh & 0xffff) << 20 |
+           quantizedDepth;
+}
+
+//LSD radix sort, 8 bits per pass, passes where every key has the same byte are skipped
+void radixSort(std::vector<DrawPacket>& packets, std::vector<DrawPacket>& scratch)
+{
+    scratch.resize(packets.size());
+    for(int shift = 0; shift < 64; shift += 8){
+        size_t counts[256] = {};
+        for(auto& packet : packets)
+            counts[(packet.key >> shift) & 0xff]++;
+        if(counts[(packets[0].key >> shift) & 0xff] == packets.size())
+            continue;
+
+        size_t offset = 0;
+        for(auto& count : counts){
+            auto current = count;
+            count = offset;
+            offset += current;
+        }
+        for(auto& packet : packets)
+            scratch[counts[(packet.key >> shift) & 0xff]++] = packet;
+        packets.swap(scratch);
+    }
+}
+
+//A model whose bounding sphere is this big on screen (in ndc, 2 is the whole height)
+//draws level 0, every halving of that size goes one level down
+const float lodReferenceSize = 0.5f;
+//How far past a level boundary the screen size has to go before the level changes
+const float lodHysteresis = 0.25f;
+//Same for HLOD proxies, as a fraction of their distance
+const float hlodHysteresis = 0.05f;
+
+uint32_t RenderBackend::selectLod(Model& model, const Mesh& mesh)
+{
+    if(mesh.lods.size() <= 1 || mesh.bounds.radius <= 0.0f)
+        return 0;
+    float distance = glm::distance(glm::vec3(camera->cameraPos), mesh.bounds.center + model.position);
+    //Inside the sphere
+    if(distance <= mesh.bounds.radius){
+        model.lod = 0;
+        return 0;
+    }
+    float screenSize = mesh.bounds.radius * std::abs(camera->proj[1][1]) / distance;
+    float level = std::log2(lodReferenceSize / screenSize) + lodBias;
+    int32_t maxLod = static_cast<int32_t>(mesh.lods.size()) - 1;
+    if(level < model.lod - lodHysteresis || level > model.lod + 1 + lodHysteresis)
+        model.lod = std::clamp(static_cast<int32_t>(std::floor(level)), 0, maxLod);
+    model.lod = std::min<uint32_t>(model.lod, maxLod);
+    return model.lod;
+}
+
+//Spheres per task when culling is split across the thread pool
+const size_t cullBatchSize = 2048;
+//Rows of the occlusion buffer and boxes per task of the cpu occlusion culling
+const size_t occlusionBandRows = 8;
+const size_t occlusionBatchSize = 256;
+
+void RenderBackend::buildDrawPackets(short frame)
+{
+    drawItems.clear();
+    drawPackets.clear();
+    framePipelines.clear();
+    auto pushModel = [&](Model& model){
+        auto meshIt = meshes.find(model.meshId);
+        if(meshIt == meshes.end())
+            return;
+        auto& mesh = meshIt->second;
+        //Still uploading
+        if(!resourceManager->isUploaded(mesh.uploadTicket) ||
+           !resourceManager->isUploaded(textures[model.textureId].uploadTicket))
+            return;
+
+        //Only one lookup per pipeline each frame
+        auto pipelineIt = framePipelines.find(model.pipeline);
+        if(pipelineIt == framePipelines.end())
+            pipelineIt = framePipelines.emplace(model.pipeline, pipelineManager->getPipeline(model.pipeline)).first;
+        auto& pipeline = pipelineIt->second;
+        //Still compiling
+        if(!pipeline.ready)
+            return;
+
+        auto& material = materials[model.material];
+        auto& lod = mesh.lods[selectLod(model, mesh)];
+        auto modelMatrix = glm::translate(glm::mat4(1.0f), model.position);
+        std::optional<uint32_t> dynamicOffset;
+        if(material.objectUniform){
+            dynamicOffset = uniformRing->push(ObjectUniform{
+                .model = modelMatrix,
+            });
+            if(!dynamicOffset.has_value())
+                return;
+        }
+
+        drawPackets.push_back(DrawPacket{
+            .key = makeSortKey(model.pipeline, model.material, model.meshId,
+                               glm::distance(glm::vec3(camera->cameraPos), model.position)),
+            .item = static_cast<uint32_t>(drawItems.size()),
+        });
+        drawItems.push_back(DrawItem{
+            .pipeline = pipeline.pipeline,
+            .pipelineLayout = pipeline.pipelineLayout,
+            .pushConstants = pipeline.pushConstants,
+            .descriptorSet = descriptorManager->getDS(material.descriptors[frame]),
+            .dynamicOffset = dynamicOffset,
+            .vertexBuffer = geometryPool->getVertexBuffer(),
+            .indexBuffer = geometryPool->getIndexBuffer(),
+            .indexCount = lod.indexCount,
+            .firstIndex = mesh.firstIndex + lod.firstIndex,
+            .vertexOffset = mesh.vertexOffset,
+            .materialIndex = static_cast<uint32_t>(material.id),
+            .instanced = material.instanced,
+            .model = modelMatrix,
+        });
+        renderStats.trianglesDrawn += lod.indexCount / 3;
+    };
+    auto gatherModel = [&](Model& model){
+        auto meshIt = meshes.find(model.meshId);
+        if(meshIt == meshes.end())
+            return;
+        //Either the members of a cluster or its proxy
+        if(model.hlod.has_value() && hlods[model.hlod.value()].proxyActive != model.hlodProxy)
+            return;
+        //Models are only translated, so the sphere just moves with them
+        auto& bounds = meshIt->second.bounds;
+        cullModels.push_back(&model);
+        cullSphereList.push(bounds.center + model.position, bounds.radius);
+    };
+    //The band around the distance keeps clusters on the edge from switching every frame
+    for(auto& [hlodId, hlod] : hlods){
+        auto& proxy = models[hlod.proxy];
+        auto& proxyMesh = meshes[proxy.meshId];
+        float distance = glm::distance(glm::vec3(camera->cameraPos), proxy.position + proxyMesh.bounds.center);
+        if(!hlodEnabled || !resourceManager->isUploaded(proxyMesh.uploadTicket))
+            hlod.proxyActive = false;
+        else if(hlod.proxyActive && distance < hlod.distance * (1.0f - hlodHysteresis))
+            hlod.proxyActive = false;
+        else if(!hlod.proxyActive && distance > hlod.distance * (1.0f + hlodHysteresis))
+            hlod.proxyActive = true;
+        renderStats.hlodProxies += hlod.proxyActive;
+    }
+    cullModels.clear();
+    cullSphereList.clear();
+    //With the GPU driven path on only the models it can't draw are walked, so
+    //the cpu cost doesn't grow with the instanced ones
+    if(gpuDriven){
+        for(auto modelId : directModelIds)
+            gatherModel(models[modelId]);
+    }
+    else{
+        for(auto& [modelId, model] : models)
+            gatherModel(model);
+    }
+
+    auto cullStart = std::chrono::steady_clock::now();
+    cullVisible.resize(cullModels.size());
+    if(frustumCulling){
+        auto frustum = extractFrustum(camera->proj * camera->view);
+        threadPool->parallelFor(cullModels.size(), cullBatchSize, [&](size_t begin, size_t end){
+            cullSpheres(frustum, cullSphereList, begin, end, cullVisible.data());
+        });
+    }
+    else
+        std::fill(cullVisible.begin(), cullVisible.end(), 1);
+    renderStats.cullMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cullStart).count();
+
+    //Visible occluders are drawn into the buffer, then every other visible model is
+    //tested against it. Occluded ones are marked with 2.
+    auto occlusionStart = std::chrono::steady_clock::now();
+    if(cpuOcclusion && !occluderMeshes.empty()){
+        occlusionBuffer->begin(camera->proj * camera->view);
+        for(size_t i = 0; i < cullModels.size(); i++){
+            auto occluderIt = occluderMeshes.find(cullModels[i]->meshId);
+            if(cullVisible[i] && occluderIt != occluderMeshes.end())
+                occlusionBuffer->addOccluder(occluderIt->second, glm::translate(glm::mat4(1.0f), cullModels[i]->position));
+        }
+        renderStats.occluderTriangles = occlusionBuffer->getTriangleCount();
+        threadPool->parallelFor(occlusionBuffer->getHeight(), occlusionBandRows, [&](size_t begin, size_t end){
+            occlusionBuffer->rasterize(begin, end);
+        });
+        threadPool->parallelFor(cullModels.size(), occlusionBatchSize, [&](size_t begin, size_t end){
+            for(size_t i = begin; i < end; i++){
+                auto& model = *cullModels[i];
+                if(!cullVisible[i] || occluderMeshes.count(model.meshId))
+                    continue;
+                auto& bounds = meshes.at(model.meshId).bounds;
+                if(occlusionBuffer->isOccluded(bounds.min + model.position, bounds.max + model.position))
+                    cullVisible[i] = 2;
+            }
+        });
+    }
+    renderStats.occlusionMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - occlusionStart).count();
+
+    for(size_t i = 0; i < cullModels.size(); i++){
+        if(cullVisible[i] == 1)
+            pushModel(*cullModels[i]);
+    }
+    renderStats.objectsVisible = std::count(cullVisible.begin(), cullVisible.end(), 1);
+    renderStats.objectsOccluded = std::count(cullVisible.begin(), cullVisible.end(), 2);
+    renderStats.objectsCulled = cullVisible.size() - renderStats.objectsVisible - renderStats.objectsOccluded;
+    if(!drawPackets.empty())
+        radixSort(drawPackets, drawPacketsScratch);
+}
+
+ObjectConstants makeObjectConstants(const glm::mat4& model, uint32_t materialIndex)
+{
+    //See https://learnopengl.com/Lighting/Basic-Lighting "One last thing"
+    auto normalMatrix = glm::mat3(glm::transpose(glm::inverse(model)));
+    return ObjectConstants{
+        .model = model,
+        .normalMatrix = {glm::vec4(normalMatrix[0], 0.0f),
+                         glm::vec4(normalMatrix[1], 0.0f),
+                         glm::vec4(normalMatrix[2], 0.0f)},
+        .materialIndex = materialIndex,
+    };
+}
+
+//Same state and mesh, so the two can be one instanced draw
+bool sameDraw(const DrawItem& a, const DrawItem& b)
+{
+    return a.pipeline == b.pipeline &&
+           a.descriptorSet == b.descriptorSet &&
+           a.vertexBuffer == b.vertexBuffer &&
+           a.indexBuffer == b.indexBuffer &&
+           a.firstIndex == b.firstIndex &&
+           a.vertexOffset == b.vertexOffset &&
+           a.indexCount == b.indexCount &&
+           //Per object data is bound once per draw, only the first item would get its own
+           a.dynamicOffset == b.dynamicOffset &&
+           !a.pushConstants.has_value() && !b.pushConstants.has_value();
+}
+
+void RenderBackend::recordDrawPackets(vk::CommandBuffer commandBuffer, short frame)
+{
+    vk::Pipeline boundPipeline;
+    vk::PipelineLayout boundLayout;
+    vk::DescriptorSet boundSet;
+    vk::Buffer boundVertexBuffer;
+    vk::Buffer boundIndexBuffer;
+    //The indirect scene owns the start of the instance buffer, the cull pass rewrites it on the gpu
+    uint32_t instanceCount = gpuDriven ? sceneInstanceSlots[frame] : 0;
+    for(size_t i = 0; i < drawPackets.size();){
+        auto& item = drawItems[drawPackets[i].item];
+        //Sorting put every copy of the same draw next to each other
+        size_t runEnd = i + 1;
+        if(item.instanced)
+            while(runEnd < drawPackets.size() && sameDraw(item, drawItems[drawPackets[runEnd].item]))
+                runEnd++;
+        uint32_t firstInstance = instanceCount;
+        if(item.instanced){
+            if(instanceCount + (runEnd - i) > maxInstanceSlots){
+                static bool warned = false;
+                if(!warned){
+                    std::cout << "[📃] RenderBackend: more than " << maxInstanceSlots << " instances, skipping draws" << std::endl;
+                    warned = true;
+                }
+                break;
+            }
+            for(size_t instance = i; instance < runEnd; instance++){
+                auto& instanceItem = drawItems[drawPackets[instance].item];
+                instanceBuffers[frame].write(makeObjectConstants(instanceItem.model, instanceItem.materialIndex), instanceCount++);
+            }
+        }
+
+        if(item.pipeline != boundPipeline){
+            commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, item.pipeline);
+            boundPipeline = item.pipeline;
+            renderStats.pipelineBinds++;
+        }
+        //Sets are only kept across pipelines with the same layout
+        if(item.pipelineLayout != boundLayout || item.descriptorSet != boundSet || item.dynamicOffset.has_value()){
+            std::vector<uint32_t> dynamicOffsets;
+            if(item.dynamicOffset.has_value())
+                dynamicOffsets.push_back(item.dynamicOffset.value());
+            commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                            item.pipelineLayout,
+                            0,
+                            item.descriptorSet,
+                            dynamicOffsets);
+            boundLayout = item.pipelineLayout;
+            boundSet = item.descriptorSet;
+            renderStats.descriptorBinds++;
+        }
+        if(item.vertexBuffer != boundVertexBuffer){
+            commandBuffer.bindVertexBuffers(0, item.vertexBuffer, vk::DeviceSize(0));
+            boundVertexBuffer = item.vertexBuffer;
+            renderStats.vertexBufferBinds++;
+        }
+        if(item.indexBuffer != boundIndexBuffer){
+            commandBuffer.bindIndexBuffer(item.indexBuffer, vk::DeviceSize(0), vk::IndexType::eUint32);
+            boundIndexBuffer = item.indexBuffer;
+            renderStats.indexBufferBinds++;
+        }
+        if(item.pushConstants.has_value()){
+            auto constants = makeObjectConstants(item.model, item.materialIndex);
+            auto& range = item.pushConstants.value();
+            commandBuffer.pushConstants(item.pipelineLayout, range.stageFlags, range.offset, range.size,
+                                        reinterpret_cast<const char*>(&constants) + range.offset);
+        }
+        //firstInstance is where the run starts in the instance buffer
+        commandBuffer.drawIndexed(item.indexCount, runEnd - i, item.firstIndex, item.vertexOffset, item.instanced ? firstInstance : 0);
+        renderStats.drawCalls++;
+        renderStats.instancesDrawn += runEnd - i;
+        i = runEnd;
+    }
+}
+
+//Both frames in flight have their own copy of the scene buffers, so both are rebuilt
+void RenderBackend::markSceneDirty()
+{
+    sceneDirtyFrames = numberFramesInFlight;
+}
+
+void RenderBackend::buildIndirectScene(short frame)
+{
+    if(sceneDirtyFrames == 0)
+        return;
+    sceneDirtyFrames--;
+
+    drawPackets.clear();
+    std::vector<Model*> sceneModels;
+    bool waiting = false;
+    for(auto& [modelId, model] : models){
+        auto& material = materials[model.material];
+        auto meshIt = meshes.find(model.meshId);
+        if(!material.instanced || model.hlod.has_value() || meshIt == meshes.end())
+            continue;
+        if(!resourceManager->isUploaded(meshIt->second.uploadTicket) ||
+           !resourceManager->isUploaded(textures[model.textureId].uploadTicket) ||
+           !pipelineManager->isPipelineReady(model.pipeline)){
+            waiting = true;
+            continue;
+        }
+        drawPackets.push_back(DrawPacket{
+            .key = makeSortKey(model.pipeline, model.material, model.meshId, 0.0f),
+            .item = static_cast<uint32_t>(sceneModels.size()),
+        });
+        sceneModels.push_back(&model);
+    }
+    //Models still loading join the scene once they are ready
+    if(waiting)
+        markSceneDirty();
+    if(!drawPackets.empty())
+        radixSort(drawPackets, drawPacketsScratch);
+
+    auto& batches = indirectBatches[frame];
+    batches.clear();
+    uint32_t commandCount = 0;
+    uint32_t objectCount = 0;
+    uint32_t instanceSlots = 0;
+    //Sorting put every copy of the same mesh and material next to each other
+    for(size_t first = 0; first < drawPackets.size();){
+        auto model = sceneModels[drawPackets[first].item];
+        auto& mesh = meshes[model->meshId];
+        size_t last = first + 1;
+        while(last < drawPackets.size()){
+            auto next = sceneModels[drawPackets[last].item];
+            if(next->pipeline != model->pipeline || next->material != model->material || next->meshId != model->meshId)
+                break;
+            last++;
+        }
+        //Every level gets a command and a range for all the copies, the cull pass picks the level of each one
+        auto levels = static_cast<uint32_t>(mesh.lods.size());
+        auto copies = static_cast<uint32_t>(std::min<size_t>(last - first, maxInstancesPerFrame - objectCount));
+        if(copies == 0 || instanceSlots + copies * levels > maxInstanceSlots || commandCount + levels > maxIndirectCommands)
+            break;
+
+        //Every mesh shares the pool buffers, so a batch can span meshes
+        auto vertexBuffer = geometryPool->getVertexBuffer();
+        auto indexBuffer = geometryPool->getIndexBuffer();
+        bool sameBatch = !batches.empty() && batches.back().pipeline == model->pipeline &&
+                         batches.back().material == model->material &&
+                         batches.back().vertexBuffer == vertexBuffer && batches.back().indexBuffer == indexBuffer;
+        if(!sameBatch && batches.size() >= maxIndirectBatches)
+            break;
+        if(!sameBatch){
+            batches.push_back(IndirectBatch{
+                .pipeline = model->pipeline,
+                .material = model->material,
+                .vertexBuffer = vertexBuffer,
+                .indexBuffer = indexBuffer,
+                .firstCommand = commandCount,
+                .commandCount = 0,
+            });
+        }
+        uint32_t firstCommand = commandCount;
+        for(uint32_t level = 0; level < levels; level++){
+            auto& lod = mesh.lods[level];
+            vk::DrawIndexedIndirectCommand command{
+                .indexCount = lod.indexCount,
+                //Without the cull pass nothing picks a level, every copy draws level 0
+                .instanceCount = level == 0 ? copies : 0,
+                .firstIndex = mesh.firstIndex + lod.firstIndex,
+                .vertexOffset = mesh.vertexOffset,
+                .firstInstance = instanceSlots + level * copies,
+            };
+            //The culling pass starts from its own copy, the draws are rewritten every frame
+            cullCommandBuffers[frame].write(CullCommand{
+                .command = command,
+                .batch = static_cast<uint32_t>(batches.size() - 1),
+                .batchFirstCommand = batches.back().firstCommand,
+            }, commandCount);
+            indirectBuffers[frame].write(command, commandCount++);
+            batches.back().commandCount++;
+        }
+        for(uint32_t copy = 0; copy < copies; copy++){
+            auto copyModel = sceneModels[drawPackets[first + copy].item];
+            auto instance = makeObjectConstants(glm::translate(glm::mat4(1.0f), copyModel->position),
+                                                static_cast<uint32_t>(copyModel->material));
+            instanceBuffers[frame].write(instance, instanceSlots + copy);
+            sceneInstanceBuffers[frame].write(instance, objectCount);
+            cullObjectBuffers[frame].write(CullObject{
+                .sphere = glm::vec4(mesh.bounds.center + copyModel->position, mesh.bounds.radius),
+                .command = firstCommand,
+                .lodCount = levels,
+            }, objectCount);
+            objectCount++;
+        }
+        instanceSlots += copies * levels;
+        first = last;
+    }
+    for(size_t batch = 0; batch < batches.size(); batch++)
+        drawCountBuffers[frame].write(batches[batch].commandCount, batch);
+    sceneObjectCounts[frame] = objectCount;
+    sceneCommandCounts[frame] = commandCount;
+    sceneInstanceSlots[frame] = instanceSlots;
+}
+
+//Three dispatches, see cull.comp. Has to be recorded outside the render pass.
+//Phase 1 runs after the pyramid was rebuilt and only redraws what phase 0 rejected for occlusion.
+void RenderBackend::recordCullPass(vk::CommandBuffer commandBuffer, short frame, uint32_t phase)
+{
+    if(phase == 0)
+        cullDispatched[frame] = false;
+    if(!cullPipeline.has_value() || !gpuCulling || sceneObjectCounts[frame] == 0)
+        return;
+
+    auto pipeline = pipelineManager->getPipeline(cullPipeline.value());
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.pipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                    pipeline.pipelineLayout,
+                    0,
+                    descriptorManager->getDS(cullDescriptors[frame]),
+                    nullptr);
+
+    if(phase == 0){
+        auto viewProjection = camera->proj * camera->view;
+        auto frustum = extractFrustum(viewProjection);
+        CullUniform uniform{
+            .viewProjection = viewProjection,
+            .pyramidViewProjection = pyramidViewProjection,
+            .depthSize = glm::vec2(surfaceSize.width, surfaceSize.height),
+            .pyramidLevels = pyramidLevels,
+            .lodBias = lodBias,
+            .cameraPosition = camera->cameraPos,
+            .projectionScale = std::abs(camera->proj[1][1]),
+            .lodReferenceSize = lodReferenceSize,
+            .lodHysteresis = lodHysteresis,
+        };
+        std::copy(std::begin(frustum.planes), std::end(frustum.planes), uniform.frustumPlanes);
+        cullUniformBuffers[frame].write(uniform);
+    }
+    else{
+        //The early draws still read the instances and commands this phase rewrites, and
+        //the pyramid was just written
+        vk::MemoryBarrier barrier{
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+        };
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader
+                                          | vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::DependencyFlags{}, barrier, nullptr, nullptr);
+    }
+
+    CullConstants constants{
+        .objectCount = sceneObjectCounts[frame],
+        .commandCount = sceneCommandCounts[frame],
+        .batchCount = static_cast<uint32_t>(indirectBatches[frame].size()),
+        .compactDraws = drawIndexedIndirectCount != nullptr,
+        .phase = phase,
+        .occlusion = occlusionActive() && pyramidValid,
+    };
+    auto& range = pipeline.pushConstants.value();
+    for(uint32_t pass = 0; pass < 3; pass++){
+        constants.pass = pass;
+        commandBuffer.pushConstants(pipeline.pipelineLayout, range.stageFlags, range.offset, range.size,
+                                    reinterpret_cast<const char*>(&constants) + range.offset);
+        uint32_t threads = pass == 1 ? constants.objectCount : constants.commandCount;
+        commandBuffer.dispatch((threads + cullGroupSize - 1) / cullGroupSize, 1, 1);
+
+        //The last pass feeds the indirect draws and the instance reads of the vertex shader,
+        //and the stats read by the host once the fence of the frame is signaled
+        bool last = pass == 2;
+        vk::MemoryBarrier barrier{
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask = last ? vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eHostRead
+                                  : vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+        };
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                      last ? vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader
+                                               | vk::PipelineStageFlagBits::eHost
+                                           : vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::DependencyFlags{}, barrier, nullptr, nullptr);
+    }
+    cullDispatched[frame] = true;
+}
+
+void RenderBackend::createCullPass()
+{
+    try{
+        cullPipeline = pipelineManager->CreateComputePipeline(cullShaderPath);
+    }
+    catch(std::exception& e){
+        std::cout << "[📃] RenderBackend: GPU culling unavailable, " << e.what() << std::endl;
+        return;
+    }
+    auto pipeline = pipelineManager->getPipeline(cullPipeline.value());
+    if(!pipeline.pushConstants.has_value() || pipeline.pushConstants->offset + pipeline.pushConstants->size > sizeof(CullConstants)){
+        std::cout << "[📃] RenderBackend: GPU culling unavailable, " << cullShaderPath << " push constants don't match CullConstants" << std::endl;
+        cullPipeline.reset();
+        return;
+    }
+
+    auto bindings = descriptorManager->getLayoutBindings(pipeline.descriptorLayout);
+    for(int frame = 0; frame < numberFramesInFlight; frame++){
+        //Indexed by binding number, in the order cull.comp declares them
+        std::vector<WriteDescriptorInfo> infos{
+            {.bufferInfo = cullObjectBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = cullCommandBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = sceneInstanceBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = instanceBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = indirectBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = drawCountBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = cullStatsBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = cullUniformBuffers[frame].getArrayDescriptorInfo()},
+            {.imageInfo = vk::DescriptorImageInfo{
+                .sampler = pyramidSampler,
+                .imageView = resourceManager->getImageView(depthPyramid),
+                .imageLayout = vk::ImageLayout::eGeneral,
+            }},
+            {.bufferInfo = cullOccludedBuffers[frame].getArrayDescriptorInfo()},
+            {.bufferInfo = cullLodBuffers[frame].getArrayDescriptorInfo()},
+        };
+        std::vector<WriteDescriptorInfo> writes;
+        for(auto& binding : bindings){
+            if(binding.binding >= infos.size()){
+                std::cout << "ERROR::createCullPass => nothing to write on binding " << binding.binding << std::endl;
+                exit(0);
+            }
+            writes.push_back(infos[binding.binding]);
+        }
+        cullDescriptors[frame] = descriptorManager->writeDS(pipeline.descriptorLayout, writes);
+    }
+    gpuCulling = true;
+}
+
+void RenderBackend::createDepthPyramid()
+{
+    //The pyramid and its sampler always exist, cull.comp binds them even without occlusion
+    pyramidSize = vk::Extent2D{
+        .width = std::max((surfaceSize.width + 1) / 2, 1u),
+        .height = std::max((surfaceSize.height + 1) / 2, 1u),
+    };
+    depthPyramid = resourceManager->createImage(pyramidSize, ImageType::eDepthPyramid);
+    pyramidLevels = mipLevelCount(pyramidSize);
+    resourceManager->transitionImage(depthPyramid, vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral);
+    //Only read with texelFetch, nothing is filtered
+    vk::SamplerCreateInfo samplerInfo{
+        .magFilter = vk::Filter::eNearest,
+        .minFilter = vk::Filter::eNearest,
+        .mipmapMode = vk::SamplerMipmapMode::eNearest,
+        .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+        .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+        .mipLodBias = 0.0f,
+        .anisotropyEnable = false,
+        .maxAnisotropy = 1,
+        .compareEnable = false,
+        .compareOp = vk::CompareOp::eAlways,
+        .minLod = 0.0f,
+        .maxLod = static_cast<float>(pyramidLevels),
+        .borderColor = vk::BorderColor::eFloatOpaqueWhite,
+        .unnormalizedCoordinates = false,
+    };
+    pyramidSampler = device.createSampler(samplerInfo);
+
+    try{
+        pyramidPipeline = pipelineManager->CreateComputePipeline(pyramidShaderPath);
+    }
+    catch(std::exception& e){
+        std::cout << "[📃] RenderBackend: occlusion culling unavailable, " << e.what() << std::endl;
+        return;
+    }
+    auto pipeline = pipelineManager->getPipeline(pyramidPipeline.value());
+    if(!pipeline.pushConstants.has_value() || pipeline.pushConstants->offset + pipeline.pushConstants->size > sizeof(PyramidConstants)){
+        std::cout << "[📃] RenderBackend: occlusion culling unavailable, " << pyramidShaderPath << " push constants don't match PyramidConstants" << std::endl;
+        pyramidPipeline.reset();
+        return;
+    }
+
+    //Level 0 reduces the depth attachment, every other level the one above it
+    for(uint32_t level = 0; level < pyramidLevels; level++){
+        std::vector<WriteDescriptorInfo> writes{
+            {.imageInfo = vk::DescriptorImageInfo{
+                .sampler = pyramidSampler,
+                .imageView = level == 0 ? resourceManager->getImageView(depthImage)
+                                        : resourceManager->getImageMipView(depthPyramid, level - 1),
+                .imageLayout = level == 0 ? vk::ImageLayout::eShaderReadOnlyOptimal : vk::ImageLayout::eGeneral,
+            }},
+            {.imageInfo = vk::DescriptorImageInfo{
+                .imageView = resourceManager->getImageMipView(depthPyramid, level),
+                .imageLayout = vk::ImageLayout::eGeneral,
+            }},
+        };
+        pyramidDescriptors.push_back(descriptorManager->writeDS(pipeline.descriptorLayout, writes));
+    }
+}
+
+//One dispatch per level, the depth has to be in eShaderReadOnlyOptimal (end of earlyRenderPass)
+void RenderBackend::recordDepthPyramid(vk::CommandBuffer commandBuffer)
+{
+    auto pipeline = pipelineManager->getPipeline(pyramidPipeline.value());
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.pipeline);
+    auto& range = pipeline.pushConstants.value();
+    //The early cull of this frame read the pyramid that is about to be overwritten
+    vk::MemoryBarrier barrier{
+        .srcAccessMask = vk::AccessFlagBits::eNone,
+        .dstAccessMask = vk::AccessFlagBits::eShaderWrite,
+    };
+    vk::Extent2D sourceSize = surfaceSize;
+    for(uint32_t level = 0; level < pyramidLevels; level++){
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::PipelineStageFlagBits::eComputeShader,
+                                      vk::DependencyFlags{}, barrier, nullptr, nullptr);
+        //Every level after the first reads what the previous dispatch wrote
+        barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+
+        vk::Extent2D destinationSize{
+            .width = std::max(pyramidSize.width >> level, 1u),
+            .height = std::max(pyramidSize.height >> level, 1u),
+        };
+        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                        pipeline.pipelineLayout,
+                        0,
+                        descriptorManager->getDS(pyramidDescriptors[level]),
+                        nullptr);
+        PyramidConstants constants{
+            .sourceSize = glm::ivec2(sourceSize.width, sourceSize.height),
+            .destinationSize = glm::ivec2(destinationSize.width, destinationSize.height),
+        };
+        commandBuffer.pushConstants(pipeline.pipelineLayout, range.stageFlags, range.offset, range.size,
+                                    reinterpret_cast<const char*>(&constants) + range.offset);
+        commandBuffer.dispatch((destinationSize.width + pyramidGroupSize - 1) / pyramidGroupSize,
+                               (destinationSize.height + pyramidGroupSize - 1) / pyramidGroupSize,
+                               1);
+        sourceSize = destinationSize;
+    }
+    //Phase 1 of the cull waits on the last level, see recordCullPass
+    pyramidViewProjection = camera->proj * camera->view;
+    pyramidValid = true;
+}
+
+bool RenderBackend::occlusionActive()
+{
+    return occlusionCulling && pyramidPipeline.has_value() && gpuDriven && gpuCulling && cullPipeline.has_value();
+}
+
+void RenderBackend::recordIndirectBatches(vk::CommandBuffer commandBuffer, short frame)
+{
+    auto stride = static_cast<uint32_t>(sizeof(vk::DrawIndexedIndirectCommand));
+    vk::Pipeline boundPipeline;
+    vk::Buffer boundVertexBuffer;
+    vk::Buffer boundIndexBuffer;
+    for(size_t batchIndex = 0; batchIndex < indirectBatches[frame].size(); batchIndex++){
+        auto& batch = indirectBatches[frame][batchIndex];
+        //Resolved every frame so hot reloaded pipelines are picked up
+        auto pipelineIt = framePipelines.find(batch.pipeline);
+        if(pipelineIt == framePipelines.end())
+            pipelineIt = framePipelines.emplace(batch.pipeline, pipelineManager->getPipeline(batch.pipeline)).first;
+        auto& pipeline = pipelineIt->second;
+        if(!pipeline.ready)
+            continue;
+
+        if(pipeline.pipeline != boundPipeline){
+            commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.pipeline);
+            boundPipeline = pipeline.pipeline;
+            renderStats.pipelineBinds++;
+        }
+        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                        pipeline.pipelineLayout,
+                        0,
+                        descriptorManager->getDS(materials[batch.material].descriptors[frame]),
+                        nullptr);
+        renderStats.descriptorBinds++;
+        if(batch.vertexBuffer != boundVertexBuffer){
+            commandBuffer.bindVertexBuffers(0, batch.vertexBuffer, vk::DeviceSize(0));
+            boundVertexBuffer = batch.vertexBuffer;
+            renderStats.vertexBufferBinds++;
+        }
+        if(batch.indexBuffer != boundIndexBuffer){
+            commandBuffer.bindIndexBuffer(batch.indexBuffer, vk::DeviceSize(0), vk::IndexType::eUint32);
+            boundIndexBuffer = batch.indexBuffer;
+            renderStats.indexBufferBinds++;
+        }
+
+        vk::DeviceSize offset = batch.firstCommand * stride;
+        if(drawIndexedIndirectCount){
+            drawIndexedIndirectCount(VkCommandBuffer(commandBuffer),
+                                     VkBuffer(indirectBuffers[frame].buffer), offset,
+                                     VkBuffer(drawCountBuffers[frame].buffer), batchIndex * sizeof(uint32_t),
+                                     batch.commandCount, stride);
+            renderStats.indirectDraws++;
+        }
+        else if(gpuFeatures.multiDrawIndirect){
+            commandBuffer.drawIndexedIndirect(indirectBuffers[frame].buffer, offset, batch.commandCount, stride);
+            renderStats.indirectDraws++;
+        }
+        else{
+            //drawCount has to be 1 without multiDrawIndirect
+            for(uint32_t command = 0; command < batch.commandCount; command++)
+                commandBuffer.drawIndexedIndirect(indirectBuffers[frame].buffer, offset + command * stride, 1, stride);
+            renderStats.indirectDraws += batch.commandCount;
+        }
+        //With GPU culling the commands are rewritten on the gpu, drawFrame takes the count from its stats
+        if(!cullDispatched[frame])
+            for(uint32_t command = 0; command < batch.commandCount; command++)
+                renderStats.instancesDrawn += indirectBuffers[frame][batch.firstCommand + command].instanceCount;
+    }
+}
+
 void RenderBackend::drawFrame()
 {
     //############# <frame render boilerplate> ###############
@@ -1538,6 +4267,28 @@ void RenderBackend::drawFrame()
     this->mFrame++;
     auto waitValue = device.waitForFences(inFlightFences[frame], false, UINT64_MAX); //XXX: Should I check this?
     device.resetFences(std::vector<vk::Fence>{inFlightFences[frame]});
+    //The fence was waited, so what the slot computed last time can be read without a stall
+    if(cullDispatched[frame]){
+        gpuVisibleObjects = cullStatsBuffers[frame][0].visibleObjects;
+        gpuOccludedObjects = cullStatsBuffers[frame][0].occludedObjects;
+    }
+    descriptorManager->beginFrame(mFrame);
+    pipelineManager->beginFrame(mFrame);
+
+    //Everything recorded since the last frame goes in a single submit
+    resourceManager->flushUploads();
+    descriptorManager->flushUpdates();
+    geometryPool->beginFrame(mFrame);
+    //A compaction finished and moved the meshes
+    if(geometryPool->getGeneration() != geometryGeneration){
+        geometryGeneration = geometryPool->getGeneration();
+        for(auto& [meshId, mesh] : meshes){
+            auto range = geometryPool->getRange(mesh.geometry);
+            mesh.vertexOffset = static_cast<int32_t>(range.vertexOffset);
+            mesh.firstIndex = range.firstIndex;
+        }
+        markSceneDirty();
+    }
 
     auto imageIndex = device.acquireNextImageKHR(swapchain, UINT64_MAX, imageAvailableSemaphores[frame]).value;
     auto commandBuffer = commands->beginCommand(commandBuffers[frame]);
@@ -1556,6 +4307,19 @@ void RenderBackend::drawFrame()
         .clearValueCount = static_cast<uint32_t>(clearValues.size()),
         .pClearValues = clearValues.data(),
     };
+    renderStats = RenderStats{};
+    auto recordStart = std::chrono::steady_clock::now();
+    //A pyramid left from before occlusion was turned off doesn't match the scene anymore
+    bool occlusion = occlusionActive();
+    if(!occlusion)
+        pyramidValid = false;
+    //Compute can't be recorded inside a render pass
+    if(gpuDriven){
+        buildIndirectScene(frame);
+        recordCullPass(commandBuffer, frame, 0);
+    }
+    if(occlusion)
+        renderPassInfo.renderPass = earlyRenderPass;
     commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
 
     vk::Viewport viewport{
@@ -1564,7 +4328,7 @@ void RenderBackend::drawFrame()
         .width = static_cast<float>(surfaceSize.width),
         .height = static_cast<float>(surfaceSize.height),
         .minDepth = 0.0f,
-        .maxDepth = 0.0f,
+        .maxDepth = 1.0f,
     };
     commandBuffer.setViewport(0, 1, &viewport);
     vk::Rect2D sissor{
@@ -1584,7 +4348,7 @@ void RenderBackend::drawFrame()
 		.lightColor = light.second.lightColor,
 	    });
 	countLights++;
-	if(countLights > 10)
+	if(countLights >= maxLights)
 	    break;
     }
     FrameUniform frameUniform{
@@ -1595,60 +4359,29 @@ void RenderBackend::drawFrame()
 	.lightsCount = static_cast<uint>(lightUniform.size()),
     };
     std::copy(lightUniform.begin(), lightUniform.end(), frameUniform.lights);
-    resourceManager->insertDataBuffer(frameUniformBuffers[frame], sizeof(FrameUniform), &frameUniform);
-
+    frameUniformBuffers[frame].write(frameUniform);
 
 
 
-    for(auto& [modelId, model]: models){
-        ObjectUniform objUniform = ObjectUniform{
-            .model = glm::translate(glm::mat4(1.0f), models[modelId].position),
-        };
-        resourceManager->insertDataBuffer(models[modelId].uniformBuffers[frame], sizeof(ObjectUniform), &objUniform);
-        descriptorManager->updateDS(models[modelId].descriptors[frame], std::vector<WriteDescriptorInfo> {
-            WriteDescriptorInfo{
-                .bufferInfo = vk::DescriptorBufferInfo{
-                    .buffer = resourceManager->getBuffer(frameUniformBuffers[frame]),
-                    .offset = 0,
-                    .range = sizeof(frameUniform), 
-                    //XXX: could this be something like getBufferRange?
-                    //or maybe typed buffers
-                },
-            },
-            WriteDescriptorInfo{
-                .bufferInfo = vk::DescriptorBufferInfo{
-                    .buffer = resourceManager->getBuffer(models[modelId].uniformBuffers[frame]),
-                    .offset = 0,
-                    .range = sizeof(objUniform),
-                },
-            },
-            WriteDescriptorInfo{
-                .imageInfo = vk::DescriptorImageInfo{
-                    .sampler = pipelineManager->getPipeline(models[modelId].pipeline).sampler,
-                    .imageView = textures[models[modelId].textureId].imageView,
-                    .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-                }
-            },
-        });
-
-        auto mesh = meshes[models[modelId].meshId];
-        std::vector<vk::Buffer> buffers{resourceManager->getBuffer(mesh.vertexBufferId)};
-        std::vector<vk::DeviceSize> offsets{vk::DeviceSize(0)};
-        commandBuffer.bindVertexBuffers(0, buffers, offsets);
-        commandBuffer.bindIndexBuffer(resourceManager->getBuffer(mesh.indexBufferId), vk::DeviceSize(0), vk::IndexType::eUint32);
 
-        commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipelineManager->getPipeline(models[modelId].pipeline).pipeline);
-        commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                        pipelineManager->getPipeline(models[modelId].pipeline).pipelineLayout,
-                        0,
-                        std::vector<vk::DescriptorSet>{descriptorManager->getDS(models[modelId].descriptors[frame])}, nullptr);
-        commandBuffer.drawIndexed(mesh.indexCount, 1, 0, 0, 0);
+    uniformRing->beginFrame(frame);
+    buildDrawPackets(frame);
+    recordDrawPackets(commandBuffer, frame);
+    if(gpuDriven)
+        recordIndirectBatches(commandBuffer, frame);
+    //Second phase, what the early pass drew becomes the occluders of what it held back
+    if(occlusion){
+        commandBuffer.endRenderPass();
+        recordDepthPyramid(commandBuffer);
+        recordCullPass(commandBuffer, frame, 1);
+        renderPassInfo.renderPass = lateRenderPass;
+        commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
+        recordIndirectBatches(commandBuffer, frame);
     }
-    
-
-    
-
-
+    //Both phases together, from the last time this slot was culled
+    if(cullDispatched[frame])
+        renderStats.instancesDrawn += gpuVisibleObjects;
+    renderStats.recordMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - recordStart).count();
 
     //ImGui stuff
     ImGui_ImplVulkan_NewFrame();
@@ -1658,6 +4391,83 @@ void RenderBackend::drawFrame()
     ImGui::ShowDemoWindow();
 
     ImGui::Begin("Debug");
+    auto allocatorStats = resourceManager->getAllocatorStats();
+    ImGui::Text("Device allocations: %lu", allocatorStats.deviceAllocations);
+    ImGui::Text("Sub allocations: %lu", allocatorStats.subAllocations);
+    ImGui::Text("Memory reserved/used/requested: %.2f/%.2f/%.2f MB",
+                allocatorStats.reservedBytes / (1024.0f * 1024.0f),
+                allocatorStats.usedBytes / (1024.0f * 1024.0f),
+                allocatorStats.requestedBytes / (1024.0f * 1024.0f));
+    auto descriptorStats = descriptorManager->getStats();
+    ImGui::Text("Descriptor writes issued/skipped: %lu/%lu (%lu update calls)",
+                descriptorStats.writesIssued,
+                descriptorStats.writesSkipped,
+                descriptorStats.updateCalls);
+    ImGui::Text("Descriptor pools: %lu, sets allocated: %lu",
+                descriptorStats.pools,
+                descriptorStats.setsAllocated);
+    auto pipelineStats = pipelineManager->getStats();
+    ImGui::Text("Pipeline cache: %s (%lu bytes loaded)",
+                pipelineStats.cacheWarm ? "warm" : "cold",
+                pipelineStats.cacheBytesLoaded);
+    ImGui::Text("Pipelines created/reused: %lu/%lu, compile time: %.2f ms",
+                pipelineStats.pipelinesCreated,
+                pipelineStats.pipelinesReused,
+                pipelineStats.compileMs);
+    ImGui::Text("Pipelines hot reloaded: %lu", pipelineStats.pipelinesReloaded);
+    auto shaderStats = pipelineManager->getShaderStats();
+    ImGui::Text("Shader modules created/reused/destroyed: %lu/%lu/%lu, %lu files mapped",
+                shaderStats.modulesCreated,
+                shaderStats.modulesReused,
+                shaderStats.modulesDestroyed,
+                shaderStats.filesMapped);
+    if(gpuFeatures.drawIndirectFirstInstance){
+        if(ImGui::Checkbox("GPU driven (indirect)", &gpuDriven))
+            markSceneDirty();
+    }
+    else
+        ImGui::Text("GPU driven unavailable: no drawIndirectFirstInstance");
+    if(cullPipeline.has_value()){
+        if(ImGui::Checkbox("GPU culling", &gpuCulling))
+            markSceneDirty();
+        ImGui::Text("GPU culling visible instances: %u", gpuVisibleObjects);
+        if(pyramidPipeline.has_value()){
+            ImGui::Checkbox("Occlusion culling (Hi-Z)", &occlusionCulling);
+            ImGui::Text("Occluded instances: %u", gpuOccludedObjects);
+        }
+    }
+    ImGui::Text("Draws: %lu, indirect: %lu (%lu instances), binds pipeline/descriptor/vertex/index: %lu/%lu/%lu/%lu, record: %.3f ms",
+                renderStats.drawCalls,
+                renderStats.indirectDraws,
+                renderStats.instancesDrawn,
+                renderStats.pipelineBinds,
+                renderStats.descriptorBinds,
+                renderStats.vertexBufferBinds,
+                renderStats.indexBufferBinds,
+                renderStats.recordMs);
+    auto geometryStats = geometryPool->getStats();
+    ImGui::Text("Geometry vertices/indices: %lu/%lu of %lu/%lu, compactions: %lu",
+                geometryStats.vertexUsed,
+                geometryStats.indexUsed,
+                geometryStats.vertexCapacity,
+                geometryStats.indexCapacity,
+                geometryStats.compactions);
+    ImGui::Checkbox("Frustum culling", &frustumCulling);
+    ImGui::Text("Objects visible/culled: %lu/%lu, cull: %.3f ms",
+                renderStats.objectsVisible,
+                renderStats.objectsCulled,
+                renderStats.cullMs);
+    ImGui::SliderFloat("LOD bias", &lodBias, -2.0f, 4.0f);
+    ImGui::Text("Triangles submitted (direct models): %lu", renderStats.trianglesDrawn);
+    ImGui::Checkbox("HLOD proxies", &hlodEnabled);
+    ImGui::Text("HLOD proxies drawn: %lu of %lu", renderStats.hlodProxies, hlods.size());
+    ImGui::Checkbox("CPU occlusion culling", &cpuOcclusion);
+    ImGui::Text("Objects occluded: %lu, occluder triangles: %lu (%ux%u), occlusion: %.3f ms",
+                renderStats.objectsOccluded,
+                renderStats.occluderTriangles,
+                occlusionBuffer->getWidth(),
+                occlusionBuffer->getHeight(),
+                renderStats.occlusionMs);
     ImGui::Text("Number of lights: %lu", lights.size());
     for(auto& light : lights){
         ImGui::Text("Light Position: (%f, %f, %f)\n",
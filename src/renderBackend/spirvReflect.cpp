@@ -0,0 +1,343 @@
+/*************************************************************************************
+ * @file spirvReflect.cpp
+ * @brief Implementation of the minimal SPIR-V reflection.
+ ************************************************************************************/
+
+#include "renderBackend/spirvReflect.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace RenderBackend {
+
+//Only the opcodes and enums the reflection looks at, see the SPIR-V specification
+const uint32_t spirvMagic = 0x07230203;
+const uint32_t spirvHeaderWords = 5;
+
+enum SpirvOp : uint32_t
+{
+    OpName = 5,
+    OpEntryPoint = 15,
+    OpTypeInt = 21,
+    OpTypeFloat = 22,
+    OpTypeVector = 23,
+    OpTypeMatrix = 24,
+    OpTypeImage = 25,
+    OpTypeSampler = 26,
+    OpTypeSampledImage = 27,
+    OpTypeArray = 28,
+    OpTypeRuntimeArray = 29,
+    OpTypeStruct = 30,
+    OpTypePointer = 32,
+    OpConstant = 43,
+    OpFunction = 54,
+    OpVariable = 59,
+    OpDecorate = 71,
+    OpMemberDecorate = 72,
+};
+
+enum SpirvDecoration : uint32_t
+{
+    DecorationBlock = 2,
+    DecorationBufferBlock = 3,
+    DecorationArrayStride = 6,
+    DecorationMatrixStride = 7,
+    DecorationBuiltIn = 11,
+    DecorationLocation = 30,
+    DecorationBinding = 33,
+    DecorationDescriptorSet = 34,
+    DecorationOffset = 35,
+};
+
+enum SpirvStorageClass : uint32_t
+{
+    StorageUniformConstant = 0,
+    StorageInput = 1,
+    StorageUniform = 2,
+    StoragePushConstant = 9,
+    StorageStorageBuffer = 12,
+};
+
+enum SpirvExecutionModel : uint32_t
+{
+    ExecutionVertex = 0,
+    ExecutionFragment = 4,
+    ExecutionGLCompute = 5,
+};
+
+struct SpirvDecorations
+{
+    bool block = false;
+    bool bufferBlock = false;
+    bool builtIn = false;
+    int64_t binding = -1;
+    int64_t set = -1;
+    int64_t location = -1;
+    uint32_t arrayStride = 0;
+};
+
+struct SpirvMember
+{
+    uint32_t offset = 0;
+    uint32_t matrixStride = 0;
+    bool builtIn = false;
+};
+
+struct SpirvModule
+{
+    uint32_t executionModel = ExecutionVertex;
+    std::unordered_map<uint32_t, std::string> names;
+    std::unordered_map<uint32_t, SpirvDecorations> decorations;
+    std::unordered_map<uint32_t, std::vector<SpirvMember>> members;
+    //type id -> opcode followed by the operands after the result id
+    std::unordered_map<uint32_t, std::vector<uint32_t>> types;
+    std::unordered_map<uint32_t, uint32_t> constants;
+    //variable id -> (pointer type, storage class)
+    std::vector<std::pair<uint32_t, std::pair<uint32_t, uint32_t>>> variables;
+    //every id that appears as an operand inside a function body
+    std::unordered_set<uint32_t> usedIds;
+};
+
+static std::string readString(const uint32_t* words, uint32_t count)
+{
+    std::string result;
+    for(uint32_t i = 0; i < count; i++){
+        for(int byte = 0; byte < 4; byte++){
+            char c = (words[i] >> (byte * 8)) & 0xff;
+            if(c == '\0')
+                return result;
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+static std::vector<SpirvMember>& getMembers(SpirvModule& module, uint32_t structId, uint32_t member)
+{
+    auto& members = module.members[structId];
+    if(members.size() <= member)
+        members.resize(member + 1);
+    return members;
+}
+
+static uint32_t typeSize(SpirvModule& module, uint32_t typeId, uint32_t matrixStride = 0)
+{
+    auto it = module.types.find(typeId);
+    if(it == module.types.end())
+        return 0;
+    auto& type = it->second;
+    switch(type[0]){
+    case OpTypeInt:
+    case OpTypeFloat:
+        return type[1] / 8;
+    case OpTypeVector:
+        return type[2] * typeSize(module, type[1]);
+    case OpTypeMatrix:
+        return type[2] * (matrixStride ? matrixStride : typeSize(module, type[1]));
+    case OpTypeArray: {
+        uint32_t stride = module.decorations[typeId].arrayStride;
+        if(stride == 0)
+            stride = typeSize(module, type[1]);
+        return stride * module.constants[type[2]];
+    }
+    case OpTypeStruct: {
+        uint32_t size = 0;
+        auto& members = module.members[typeId];
+        for(uint32_t i = 1; i < type.size(); i++){
+            SpirvMember member = i - 1 < members.size() ? members[i - 1] : SpirvMember{};
+            size = std::max(size, member.offset + typeSize(module, type[i], member.matrixStride));
+        }
+        return size;
+    }
+    default:
+        return 0;
+    }
+}
+
+static SpirvModule parseModule(const uint32_t* code, size_t wordCount)
+{
+    if(wordCount < spirvHeaderWords || code[0] != spirvMagic)
+        throw std::runtime_error("reflectSpirv: not a SPIR-V module");
+
+    SpirvModule module;
+    bool entryPointFound = false;
+    bool insideFunctions = false;
+    size_t position = spirvHeaderWords;
+    while(position < wordCount){
+        uint32_t opcode = code[position] & 0xffff;
+        uint32_t count = code[position] >> 16;
+        if(count == 0 || position + count > wordCount)
+            throw std::runtime_error("reflectSpirv: malformed instruction");
+        const uint32_t* operands = code + position + 1;
+        uint32_t operandCount = count - 1;
+        position += count;
+
+        if(opcode == OpFunction)
+            insideFunctions = true;
+        if(insideFunctions){
+            for(uint32_t i = 0; i < operandCount; i++)
+                module.usedIds.insert(operands[i]);
+            continue;
+        }
+
+        switch(opcode){
+        case OpName:
+            module.names[operands[0]] = readString(operands + 1, operandCount - 1);
+            break;
+        case OpEntryPoint:
+            if(!entryPointFound)
+                module.executionModel = operands[0];
+            entryPointFound = true;
+            break;
+        case OpDecorate: {
+            auto& decoration = module.decorations[operands[0]];
+            switch(operands[1]){
+            case DecorationBlock: decoration.block = true; break;
+            case DecorationBufferBlock: decoration.bufferBlock = true; break;
+            case DecorationBuiltIn: decoration.builtIn = true; break;
+            case DecorationArrayStride: decoration.arrayStride = operands[2]; break;
+            case DecorationLocation: decoration.location = operands[2]; break;
+            case DecorationBinding: decoration.binding = operands[2]; break;
+            case DecorationDescriptorSet: decoration.set = operands[2]; break;
+            }
+            break;
+        }
+        case OpMemberDecorate: {
+            auto& member = getMembers(module, operands[0], operands[1])[operands[1]];
+            switch(operands[2]){
+            case DecorationOffset: member.offset = operands[3]; break;
+            case DecorationMatrixStride: member.matrixStride = operands[3]; break;
+            case DecorationBuiltIn: member.builtIn = true; break;
+            }
+            break;
+        }
+        case OpTypeInt:
+        case OpTypeFloat:
+        case OpTypeVector:
+        case OpTypeMatrix:
+        case OpTypeImage:
+        case OpTypeSampler:
+        case OpTypeSampledImage:
+        case OpTypeArray:
+        case OpTypeRuntimeArray:
+        case OpTypeStruct:
+        case OpTypePointer: {
+            std::vector<uint32_t> type{opcode};
+            type.insert(type.end(), operands + 1, operands + operandCount);
+            module.types[operands[0]] = type;
+            break;
+        }
+        case OpConstant:
+            module.constants[operands[1]] = operands[2];
+            break;
+        case OpVariable:
+            module.variables.push_back({operands[1], {operands[0], operands[2]}});
+            break;
+        }
+    }
+    return module;
+}
+
+ShaderReflection reflectSpirv(const uint32_t* code, size_t wordCount)
+{
+    auto module = parseModule(code, wordCount);
+
+    ShaderReflection reflection{};
+    switch(module.executionModel){
+    case ExecutionVertex: reflection.stage = eStageVertex; break;
+    case ExecutionFragment: reflection.stage = eStageFragment; break;
+    case ExecutionGLCompute: reflection.stage = eStageCompute; break;
+    }
+
+    for(auto& [variableId, variable] : module.variables){
+        auto [pointerId, storageClass] = variable;
+        if(!module.usedIds.count(variableId))
+            continue;
+        uint32_t typeId = module.types[pointerId][2];
+        auto& decoration = module.decorations[variableId];
+
+        if(storageClass == StorageInput){
+            if(reflection.stage != eStageVertex || decoration.builtIn || decoration.location < 0)
+                continue;
+            auto type = module.types[typeId];
+            uint32_t components = 1;
+            if(type[0] == OpTypeVector){
+                components = type[2];
+                type = module.types[type[1]];
+            }
+            reflection.vertexInputs.push_back(ReflectedVertexInput{
+                .location = static_cast<uint32_t>(decoration.location),
+                .baseType = type[0] == OpTypeFloat ? ReflectedBaseType::eFloat :
+                            (type[2] ? ReflectedBaseType::eInt : ReflectedBaseType::eUint),
+                .components = components,
+                .width = type[1],
+                .name = module.names[variableId],
+            });
+            continue;
+        }
+
+        if(storageClass == StoragePushConstant){
+            uint32_t offset = UINT32_MAX;
+            for(auto& member : module.members[typeId])
+                offset = std::min(offset, member.offset);
+            if(offset == UINT32_MAX)
+                offset = 0;
+            reflection.pushConstants.push_back(ReflectedPushConstant{
+                .offset = offset,
+                .size = typeSize(module, typeId) - offset,
+            });
+            continue;
+        }
+
+        if(storageClass != StorageUniformConstant && storageClass != StorageUniform &&
+           storageClass != StorageStorageBuffer)
+            continue;
+
+        uint32_t descriptorCount = 1;
+        while(module.types[typeId][0] == OpTypeArray || module.types[typeId][0] == OpTypeRuntimeArray){
+            auto& array = module.types[typeId];
+            //runtime arrays of descriptors are sized by the application
+            if(array[0] == OpTypeArray)
+                descriptorCount *= module.constants[array[2]];
+            typeId = array[1];
+        }
+
+        auto& type = module.types[typeId];
+        ReflectedDescriptorType descriptorType;
+        uint32_t size = 0;
+        if(type[0] == OpTypeSampledImage)
+            descriptorType = ReflectedDescriptorType::eCombinedImageSampler;
+        else if(type[0] == OpTypeImage)
+            descriptorType = type[6] == 2 ? ReflectedDescriptorType::eStorageImage : ReflectedDescriptorType::eSampledImage;
+        else if(type[0] == OpTypeSampler)
+            descriptorType = ReflectedDescriptorType::eSampler;
+        else if(type[0] == OpTypeStruct){
+            bool storage = storageClass == StorageStorageBuffer || module.decorations[typeId].bufferBlock;
+            descriptorType = storage ? ReflectedDescriptorType::eStorageBuffer : ReflectedDescriptorType::eUniformBuffer;
+            size = typeSize(module, typeId);
+        }
+        else
+            continue;
+
+        reflection.bindings.push_back(ReflectedBinding{
+            .set = static_cast<uint32_t>(std::max<int64_t>(decoration.set, 0)),
+            .binding = static_cast<uint32_t>(std::max<int64_t>(decoration.binding, 0)),
+            .type = descriptorType,
+            .count = descriptorCount,
+            .size = size,
+            .name = module.names[variableId],
+        });
+    }
+
+    std::sort(reflection.bindings.begin(), reflection.bindings.end(), [](auto& a, auto& b){
+        return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+    });
+    std::sort(reflection.vertexInputs.begin(), reflection.vertexInputs.end(), [](auto& a, auto& b){
+        return a.location < b.location;
+    });
+    return reflection;
+}
+
+}